@@ -19,11 +19,13 @@
  * }}}
  */
 
+#include <cmath>
 #include <iostream>
 #include <string>
 
 #include <map-reduce/map>
 #include <map-reduce/array>
+#include <map-reduce/convolution>
 #include <map-reduce/dynarray>
 #include <map-reduce/reduce>
 
@@ -360,6 +362,90 @@ void test_convolution_dyn()
     std::cout << std::endl;
 }
 
+template <int Order>
+size_t test_convolution_method_instance(dynarray<data_type, 2> &a, dynarray<data_type, 2> &b,
+                                        const dynarray<data_type, 2> &conv, size_t N, size_t M,
+                                        convolution_method method, convolution_method &used)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = N * i + j + 1;
+        },
+        make_range(N, M));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    used = convolve(b, a, N, M, conv, 2 * Order + 1, method, map_sched::parallel<>());
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+// Relative error of the interior of b with respect to gold
+template <int Order>
+double test_convolution_method_error(const dynarray<data_type, 2> &b, const dynarray<data_type, 2> &gold,
+                                     size_t N, size_t M)
+{
+    return reduce_max([&](int i, int j)
+                      {
+                          double diff = std::fabs(double(b(i, j)) - double(gold(i, j)));
+                          return diff / std::max(std::fabs(double(gold(i, j))), 1.0);
+                      },
+                      make_range(dim<int>(Order, int(N) - Order),
+                                 dim<int>(Order, int(M) - Order)));
+}
+
+// direct, separable and fft methods, and the method picked by automatic for a non-separable kernel
+template <size_t Order, size_t N>
+void test_convolution_methods()
+{
+    static const char *Names[] = { "automatic", "direct", "separable", "fft" };
+    static const convolution_method Methods[] = { convolution_method::direct, convolution_method::separable,
+                                                  convolution_method::fft, convolution_method::automatic };
+
+    dynarray<data_type, 2> a(N, N), b(N, N), gold(N, N), gold_sep(N, N);
+    dynarray<data_type, 2> conv(2 * Order + 1, 2 * Order + 1), conv_sep(2 * Order + 1, 2 * Order + 1);
+
+    map([&](int i, int j)
+        {
+            conv(i, j)     = i + j;
+            conv_sep(i, j) = (i + 1) * (2 * Order + 1 - j);
+        },
+        make_range(2 * Order + 1,
+                   2 * Order + 1));
+
+    std::cout << "F:" << Order << "_" << N;
+
+    std::vector<size_t> usecs(Iterations);
+    convolution_method used = convolution_method::automatic;
+
+    if (DoTest) {
+        test_convolution_method_instance<Order>(a, gold, conv, N, N, convolution_method::direct, used);
+        test_convolution_method_instance<Order>(a, gold_sep, conv_sep, N, N, convolution_method::direct, used);
+    }
+
+    for (convolution_method method : Methods) {
+        const dynarray<data_type, 2> &kernel = method == convolution_method::separable? conv_sep: conv;
+
+        for (unsigned it = 0; it < Iterations; ++it) {
+            usecs[it] = test_convolution_method_instance<Order>(a, b, kernel, N, N, method, used);
+        }
+        std::cout << ","; print_stats(usecs);
+
+        if (DoTest) {
+            assert(test_convolution_method_error<Order>(b, method == convolution_method::separable? gold_sep: gold,
+                                                        N, N) < 1e-3);
+        }
+    }
+
+    std::cout << "," << Names[int(used)] << std::endl;
+}
+
 template <size_t Order, size_t N>
 void test_convolution_boost()
 {
@@ -410,6 +496,13 @@ void test_instance()
 #endif
 }
 
+template <size_t Order>
+void test_methods()
+{
+    test_convolution_methods<Order, 400>();
+    test_convolution_methods<Order, 1600>();
+}
+
 void test_convolution()
 {
     test_instance<1, 200>();
@@ -438,6 +531,13 @@ void test_convolution()
     test_instance<8, 800>();
     test_instance<8, 1600>();
     test_instance<8, 3200>();
+
+    test_methods<1>();
+    test_methods<2>();
+    test_methods<4>();
+    test_methods<8>();
+    test_methods<16>();
+    test_methods<32>();
 }
 
 int main(int argc, char *argv[])
@@ -19,13 +19,20 @@
  * }}}
  */
 
+#include <algorithm>
 #include <iostream>
+#include <random>
 #include <string>
 
 #include <map-reduce/map>
 #include <map-reduce/array>
+#include <map-reduce/batch>
 #include <map-reduce/dynarray>
+#include <map-reduce/gemm>
+#include <map-reduce/graph>
+#include <map-reduce/ragged>
 #include <map-reduce/reduce>
+#include <map-reduce/sparse>
 
 #include <boost/multi_array.hpp>
 
@@ -174,6 +181,37 @@ size_t test_matrixmul_dyn_instance(T &c, T &a, T &b, size_t N, size_t M)
     return microsecond_cast(end - start).count();
 }
 
+template <typename TC, typename TA, typename TB>
+size_t test_matrixmul_layout_instance(TC &c, TA &a, TB &b, size_t N)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = N * i + j + 1;
+            b(i, j) = N * i + j + 1;
+        },
+        make_range(N, N));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    map([&](int i, int j)
+        {
+            data_type tmp = 0;
+            for (unsigned k = 0; k < N; ++k) {
+                tmp += a(i, k) * b(k, j);
+            }
+            c(i, j) = tmp;
+        },
+        make_range(N, N));
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
 template <size_t N>
 void test_matrixmul_static()
 {
@@ -266,6 +304,424 @@ void test_matrixmul_dyn()
     std::cout << std::endl;
 }
 
+template <size_t N>
+void test_matrixmul_layout()
+{
+    using row_type   = dynarray<data_type, 2, layout_row_major>;
+    using col_type   = dynarray<data_type, 2, layout_col_major>;
+    using tiled_type = dynarray<data_type, 2, layout_tiled<8>>;
+
+    row_type a(N, N);
+    row_type b(N, N);
+    row_type c(N, N);
+    row_type c_gold(N, N);
+
+    col_type b_col(N, N);
+
+    tiled_type a_tiled(N, N);
+    tiled_type b_tiled(N, N);
+
+    std::cout << "L:" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    // Row-major A and B
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_layout_instance(c_gold, a, b, N);
+    }
+    print_stats(usecs);
+
+    // Row-major A and column-major B: both operands are traversed with unit stride
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_layout_instance(c, a, b_col, N);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(c == c_gold);
+    }
+
+    // 8x8 tiles for A and B
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_layout_instance(c, a_tiled, b_tiled, N);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(c == c_gold);
+    }
+
+    std::cout << std::endl;
+}
+
+template <size_t N>
+void test_matrixmul_gemm()
+{
+    using array_type = dynarray<data_type, 2>;
+    array_type a(N, N);
+    array_type b(N, N);
+    array_type c(N, N);
+    array_type c_gold(N, N);
+
+    std::cout << "G:" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_dyn_instance<matrixmul_impl::map, array_type>(c_gold, a, b, N, N);
+    }
+    print_stats(usecs);
+    std::cout << "," << 2.0 * N * N * N / (1e3 * std::max<size_t>(1, *std::min_element(usecs.begin(), usecs.end())));
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        my_time_point start, end;
+
+        fill_cache();
+
+        start = my_clock::now();
+        gemm(c, a, b, N, N, N, map_sched::parallel<>());
+        end = my_clock::now();
+
+        usecs[it] = microsecond_cast(end - start).count();
+    }
+    std::cout << ","; print_stats(usecs);
+    std::cout << "," << 2.0 * N * N * N / (1e3 * std::max<size_t>(1, *std::min_element(usecs.begin(), usecs.end())));
+
+    if (DoTest) {
+        assert(c == c_gold);
+    }
+
+    std::cout << std::endl;
+}
+
+// Initialization, product and checksum: one parallel call after the other vs a task graph. In the graph,
+// both initializations run concurrently, and the rows of the product start as soon as their rows of a
+// are ready
+template <size_t N>
+size_t test_matrixmul_graph_instance(dynarray<data_type, 2> &c, dynarray<data_type, 2> &a, dynarray<data_type, 2> &b,
+                                     data_type &sum, bool graph)
+{
+    my_time_point start, end;
+
+    auto init_a = [&](int i, int j)
+                  {
+                      a(i, j) = data_type((N * i + j + 1) % 32);
+                  };
+    auto init_b = [&](int i, int j)
+                  {
+                      b(i, j) = data_type((N * j + i + 1) % 32);
+                  };
+    auto mul = [&](int i, int j)
+               {
+                   data_type tmp = 0;
+                   for (unsigned k = 0; k < N; ++k) {
+                       tmp += a(i, k) * b(k, j);
+                   }
+                   c(i, j) = tmp;
+               };
+    auto elem = [&](int i, int j)
+                {
+                    return c(i, j);
+                };
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    if (graph) {
+        task_graph g;
+        g.map("init a", init_a, make_range(N, N)).writes_tile(a);
+        g.map("init b", init_b, make_range(N, N)).writes_tile(b);
+        g.map("mul", mul, make_range(N, N)).reads_tile(a).reads(b).writes_tile(c);
+        g.reduce("sum", elem, reduce_ops<data_type>::add, make_range(N, N), sum).reads_tile(c);
+        g.run();
+    } else {
+        map(init_a, make_range(N, N), map_sched::parallel<>());
+        map(init_b, make_range(N, N), map_sched::parallel<>());
+        map(mul, make_range(N, N), map_sched::parallel<>());
+        sum = reduce(elem, reduce_ops<data_type>::add, make_range(N, N), reduce_sched::parallel<>());
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t N>
+void test_matrixmul_graph()
+{
+    dynarray<data_type, 2> a(N, N), b(N, N), c(N, N), c_gold(N, N);
+    data_type sum = 0, sum_gold = 0;
+
+    std::cout << "T:" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_graph_instance<N>(c_gold, a, b, sum_gold, false);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_graph_instance<N>(c, a, b, sum, true);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(c == c_gold);
+        assert(sum == sum_gold);
+    }
+
+    std::cout << std::endl;
+}
+
+// Lower triangle of the symmetric product c = a * a^T: the full square skipping the upper half vs a triangular range
+template <size_t N>
+size_t test_matrixmul_symm_instance(dynarray<data_type, 2> &c, const dynarray<data_type, 2> &a, bool triangular)
+{
+    my_time_point start, end;
+
+    auto body = [&](int i, int j)
+                {
+                    data_type tmp = 0;
+                    for (unsigned k = 0; k < N; ++k) {
+                        tmp += a(i, k) * a(j, k);
+                    }
+                    c(i, j) = tmp;
+                };
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    if (triangular) {
+        map(body, make_triangle_range(N), map_sched::parallel<>());
+    } else {
+        map([&](int i, int j)
+            {
+                if (j <= i) body(i, j);
+            },
+            make_range(N, N),
+            map_sched::parallel<>());
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t N>
+void test_matrixmul_symm()
+{
+    dynarray<data_type, 2> a(N, N), c(N, N), c_gold(N, N);
+
+    map([&](int i, int j)
+        {
+            a(i, j) = data_type((i * 7 + j) % 16);
+        },
+        make_range(N, N));
+
+    std::cout << "Y:" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_symm_instance<N>(c_gold, a, false);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_symm_instance<N>(c, a, true);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j <= i; ++j) {
+                assert(c(i, j) == c_gold(i, j));
+            }
+        }
+    }
+
+    std::cout << std::endl;
+}
+
+// Matrix-vector product with a sparse matrix, dense (map) vs CSR (spmv)
+template <typename T>
+size_t test_matrixmul_sparse_instance(T &y, const T &x, const dynarray<data_type, 2> &a, size_t N)
+{
+    my_time_point start, end;
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    map([&](int i)
+        {
+            data_type tmp = 0;
+            for (unsigned k = 0; k < N; ++k) {
+                tmp += a(i, k) * x[k];
+            }
+            y[i] = tmp;
+        },
+        make_range(N));
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <typename T>
+size_t test_matrixmul_sparse_instance(T &y, const T &x, const csr_array<data_type> &a, size_t /* N */)
+{
+    my_time_point start, end;
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    spmv(y, a, x);
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t N>
+void test_matrixmul_sparse()
+{
+    static const unsigned Densities[] = { 1, 10, 50 };
+
+    dynarray<data_type, 2> a(N, N);
+    array<data_type[N]> x;
+    array<data_type[N]> y;
+    array<data_type[N]> y_gold;
+
+    map([&](int i)
+        {
+            x[i] = i + 1;
+        },
+        make_range(N));
+
+    std::cout << "V:" << N;
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned density : Densities) {
+        std::mt19937 gen(N + density);
+        std::uniform_int_distribution<unsigned> percent(0, 99);
+        for (unsigned i = 0; i < N; ++i) {
+            for (unsigned j = 0; j < N; ++j) {
+                a(i, j) = percent(gen) < density? data_type(N * i + j + 1): data_type(0);
+            }
+        }
+
+        csr_array<data_type> a_csr(N, N, [&](int i, int j)
+                                         {
+                                             return a(i, j);
+                                         });
+
+        for (unsigned it = 0; it < Iterations; ++it) {
+            usecs[it] = test_matrixmul_sparse_instance(y_gold, x, a, N);
+        }
+        std::cout << ","; print_stats(usecs);
+
+        for (unsigned it = 0; it < Iterations; ++it) {
+            usecs[it] = test_matrixmul_sparse_instance(y, x, a_csr, N);
+        }
+        std::cout << ","; print_stats(usecs);
+
+        if (DoTest) {
+            assert(y == y_gold);
+        }
+    }
+
+    std::cout << std::endl;
+}
+
+// Batches of S x S matrices: one parallel map per matrix vs batch_gemm with both batch layouts
+template <size_t S, typename Layout>
+size_t test_matrixmul_batch_instance(dynarray<data_type, 3, Layout> &c, const dynarray<data_type, 3, Layout> &a,
+                                     const dynarray<data_type, 3, Layout> &b, size_t count, bool batched)
+{
+    my_time_point start, end;
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    if (batched) {
+        batch_gemm<S, S, S>(c, a, b, map_sched::parallel<>());
+    } else {
+        for (size_t m = 0; m < count; ++m) {
+            map([&](int i, int j)
+                {
+                    data_type tmp = 0;
+                    for (unsigned k = 0; k < S; ++k) {
+                        tmp += a(m, i, k) * b(m, k, j);
+                    }
+                    c(m, i, j) = tmp;
+                },
+                make_range(S, S),
+                map_sched::parallel<>());
+        }
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t S>
+void test_matrixmul_batch()
+{
+    static const size_t Count = (size_t(1) << 22) / (S * S);
+
+    dynarray<data_type, 3> a(Count, S, S), b(Count, S, S), c(Count, S, S), c_gold(Count, S, S);
+    dynarray<data_type, 3, layout_col_major> a_col(Count, S, S), b_col(Count, S, S), c_col(Count, S, S);
+
+    map([&](int m, int i, int j)
+        {
+            a(m, i, j) = a_col(m, i, j) = (m + i * S + j) % 16;
+            b(m, i, j) = b_col(m, i, j) = (m + i + j * S) % 16;
+        },
+        make_range(Count, S, S));
+
+    std::cout << "X:" << S << "_" << Count << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_batch_instance<S>(c_gold, a, b, Count, false);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_batch_instance<S>(c, a, b, Count, true);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(c == c_gold);
+    }
+
+    // The batch index has unit stride: the kernel is vectorized across matrices
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_matrixmul_batch_instance<S>(c_col, a_col, b_col, Count, true);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        map([&](int m, int i, int j)
+            {
+                assert(c_col(m, i, j) == c_gold(m, i, j));
+            },
+            make_range(Count, S, S));
+    }
+
+    std::cout << std::endl;
+}
+
 template <size_t N>
 void test_matrixmul_boost()
 {
@@ -303,6 +759,11 @@ void test_instance()
     test_matrixmul_static<N>();
     test_matrixmul<N>();
     test_matrixmul_dyn<N>();
+    test_matrixmul_layout<N>();
+    test_matrixmul_sparse<N>();
+    test_matrixmul_gemm<N>();
+    test_matrixmul_graph<N>();
+    test_matrixmul_symm<N>();
 #if 0
     test_matrixmul_boost<N>();
 #endif
@@ -318,6 +779,11 @@ void test_matrixmul()
     test_instance<600>();
     test_instance<700>();
     test_instance<800>();
+
+    test_matrixmul_batch<4>();
+    test_matrixmul_batch<8>();
+    test_matrixmul_batch<16>();
+    test_matrixmul_batch<32>();
 }
 
 int main(int argc, char *argv[])
@@ -19,13 +19,19 @@
  * }}}
  */
 
+#include <cmath>
 #include <iostream>
 #include <string>
 
 #include <map-reduce/map>
 #include <map-reduce/array>
+#include <map-reduce/curve>
 #include <map-reduce/dynarray>
 #include <map-reduce/reduce>
+#include <map-reduce/half>
+#include <map-reduce/iterate>
+#include <map-reduce/masked>
+#include <map-reduce/stencil>
 
 #include <boost/multi_array.hpp>
 
@@ -298,6 +304,606 @@ void test_stencil_dyn()
     std::cout << std::endl;
 }
 
+// The elements are stored in T but the stencil is always computed in float
+template <int Order, typename T>
+size_t test_stencil_precision_instance(dynarray<T, 2> &a, dynarray<T, 2> &b, size_t N, size_t M)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = float((i * 7 + j * 13) % 256) / 256;
+        },
+        make_range(N, M));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    map([&](int i, int j)
+        {
+            float tmp = a(i, j);
+            for (int k = 1; k <= Order; ++k) {
+                tmp += float(a(i - k, j)) + float(a(i + k, j)) +
+                       float(a(i, j - k)) + float(a(i, j + k));
+            }
+
+            b(i, j) = tmp;
+        },
+        make_range(dim<int>(Order, int(N) - Order),
+                   dim<int>(Order, int(M) - Order)));
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+// Same stencil, but the rows are converted in bulk (vectorized) into float scratch rows first
+template <int Order, typename T>
+size_t test_stencil_precision_rows_instance(dynarray<T, 2> &a, dynarray<T, 2> &b, size_t N, size_t M)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = float((i * 7 + j * 13) % 256) / 256;
+        },
+        make_range(N, M));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    map([&](int i)
+        {
+            std::vector<float> rows((2 * Order + 2) * M);
+            float *out = &rows[(2 * Order + 1) * M];
+
+            for (int k = -Order; k <= Order; ++k) {
+                widen(&rows[(k + Order) * M], &a(i + k, 0), M);
+            }
+
+            const float *row = &rows[Order * M];
+            for (unsigned j = Order; j < M - Order; ++j) {
+                float tmp = row[j];
+                for (int k = 1; k <= Order; ++k) {
+                    tmp += rows[(Order - k) * M + j] + rows[(Order + k) * M + j] +
+                           row[j - k] + row[j + k];
+                }
+                out[j] = tmp;
+            }
+
+            narrow(&b(i, Order), out + Order, M - 2 * Order);
+        },
+        make_range(dim<int>(Order, int(N) - Order)));
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <int Order, typename T>
+float test_stencil_precision_error(const dynarray<T, 2> &b, const dynarray<float, 2> &gold, size_t N, size_t M)
+{
+    return reduce_max([&](int i, int j)
+                      {
+                          float err = float(b(i, j)) - gold(i, j);
+                          return err < 0? -err: err;
+                      },
+                      make_range(dim<int>(Order, int(N) - Order),
+                                 dim<int>(Order, int(M) - Order)));
+}
+
+template <size_t Order, size_t N>
+void test_stencil_precision()
+{
+    dynarray<float, 2>    a(N, N),   b(N, N);
+    dynarray<half, 2>     a_h(N, N), b_h(N, N);
+    dynarray<bfloat16, 2> a_b(N, N), b_b(N, N);
+
+    std::cout << "H:" << Order << "_" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_precision_instance<Order>(a, b, N, N);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_precision_instance<Order>(a_h, b_h, N, N);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_precision_instance<Order>(a_b, b_b, N, N);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_precision_rows_instance<Order>(a_h, b_h, N, N);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_precision_rows_instance<Order>(a_b, b_b, N, N);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    // Maximum absolute error with respect to float storage
+    std::cout << "," << test_stencil_precision_error<Order>(b_h, b, N, N)
+              << "," << test_stencil_precision_error<Order>(b_b, b, N, N);
+
+    std::cout << std::endl;
+}
+
+// Several time steps per pass over the grid. The kernel averages so that values do not grow over the steps
+template <int Order>
+size_t test_stencil_blocking_instance(dynarray<data_type, 2> &a, dynarray<data_type, 2> &b, size_t N, size_t M,
+                                      size_t steps, const stencil_tiling &tiling, dynarray<data_type, 2> *&res)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = (N * i + j + 1) % 1024;
+        },
+        make_range(N, M));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    subarray<data_type, 2, 2> &out =
+        stencil_iterate<Order>(a, b, steps,
+                               [](const stencil_grid<data_type> &in, int i, int j) -> data_type
+                               {
+                                   data_type tmp = in(i, j);
+                                   for (int k = 1; k <= Order; ++k) {
+                                       tmp += in(i - k, j) + in(i + k, j) +
+                                              in(i, j - k) + in(i, j + k);
+                                   }
+                                   return tmp / (4 * Order + 1);
+                               },
+                               tiling,
+                               map_sched::parallel<>());
+
+    end = my_clock::now();
+
+    res = &out == &a? &a: &b;
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t Order, size_t N>
+void test_stencil_blocking()
+{
+    static const size_t Steps = 8;
+    static const size_t Blocks[] = { 1, 2, 4, 8 };
+
+    dynarray<data_type, 2> a(N, N), b(N, N);
+    dynarray<data_type, 2> gold(N, N);
+
+    std::cout << "T:" << Order << "_" << N;
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (size_t block : Blocks) {
+        dynarray<data_type, 2> *res = nullptr;
+
+        for (unsigned it = 0; it < Iterations; ++it) {
+            usecs[it] = test_stencil_blocking_instance<Order>(a, b, N, N, Steps, stencil_tiling(block), res);
+        }
+        std::cout << ","; print_stats(usecs);
+
+        if (DoTest) {
+            if (block == 1) {
+                std::copy(&(*res)(0, 0), &(*res)(0, 0) + N * N, &gold(0, 0));
+            } else {
+                assert(*res == gold);
+            }
+        }
+    }
+
+    std::cout << std::endl;
+}
+
+// The same star stencil written as a map body and generated from its descriptor
+template <int Order>
+size_t test_stencil_spec_instance(dynarray<data_type, 2> &a, dynarray<data_type, 2> &b, size_t N, size_t M,
+                                  bool spec, stencil_boundary boundary)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = N * i + j + 1;
+        },
+        make_range(N, M));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    if (spec) {
+        stencil_apply<typename stencil_star<Order>::type>(b, a, boundary, map_sched::parallel<>());
+    } else {
+        map([&](int i, int j)
+            {
+                data_type tmp = a(i, j);
+                for (int k = 1; k <= Order; ++k) {
+                    tmp += a(i - k, j) + a(i + k, j) +
+                           a(i, j - k) + a(i, j + k);
+                }
+
+                b(i, j) = tmp;
+            },
+            make_range(dim<int>(Order, int(N) - Order),
+                       dim<int>(Order, int(M) - Order)),
+            map_sched::parallel<>());
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t Order, size_t N>
+void test_stencil_spec()
+{
+    dynarray<data_type, 2> a(N, N), b(N, N), c(N, N);
+
+    std::cout << "U:" << Order << "_" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_spec_instance<Order>(a, c, N, N, false, stencil_boundary::copy);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_spec_instance<Order>(a, b, N, N, true, stencil_boundary::copy);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        for (size_t i = Order; i < N - Order; ++i) {
+            for (size_t j = Order; j < N - Order; ++j) {
+                assert(b(i, j) == c(i, j));
+            }
+        }
+    }
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_spec_instance<Order>(a, b, N, N, true, stencil_boundary::periodic);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    std::cout << std::endl;
+}
+
+// The star stencil traversed in row-major, Morton and Hilbert order
+template <int Order, typename Policy>
+size_t test_stencil_curve_instance(dynarray<data_type, 2> &a, dynarray<data_type, 2> &b, size_t N, size_t M,
+                                   const Policy &p)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = N * i + j + 1;
+        },
+        make_range(N, M));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    map([&](int i, int j)
+        {
+            data_type tmp = a(i, j);
+            for (int k = 1; k <= Order; ++k) {
+                tmp += a(i - k, j) + a(i + k, j) +
+                       a(i, j - k) + a(i, j + k);
+            }
+
+            b(i, j) = tmp;
+        },
+        make_range(dim<int>(Order, int(N) - Order),
+                   dim<int>(Order, int(M) - Order)),
+        p);
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t Order, size_t N>
+void test_stencil_curve()
+{
+    dynarray<data_type, 2> a(N, N), b(N, N), c(N, N);
+
+    std::cout << "Z:" << Order << "_" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_curve_instance<Order>(a, c, N, N, map_sched::parallel<>());
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_curve_instance<Order>(a, b, N, N, map_sched::morton<>());
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        for (size_t i = Order; i < N - Order; ++i) {
+            for (size_t j = Order; j < N - Order; ++j) {
+                assert(b(i, j) == c(i, j));
+            }
+        }
+    }
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_curve_instance<Order>(a, b, N, N, map_sched::hilbert<>());
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        for (size_t i = Order; i < N - Order; ++i) {
+            for (size_t j = Order; j < N - Order; ++j) {
+                assert(b(i, j) == c(i, j));
+            }
+        }
+    }
+
+    std::cout << std::endl;
+}
+
+// Red-black Gauss-Seidel sweeps: loops that compute the first column of every row vs maps over
+// strided ranges with a constant step of 2
+template <size_t N>
+size_t test_stencil_redblack_instance(dynarray<data_type, 2> &x, size_t sweeps, bool strided)
+{
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            x(i, j) = data_type((i * 7 + j * 3) % 11);
+        },
+        make_range(N, N));
+
+    auto update = [&](int i, int j)
+                  {
+                      x(i, j) = (x(i - 1, j) + x(i + 1, j) + x(i, j - 1) + x(i, j + 1)) / 4;
+                  };
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    for (size_t s = 0; s < sweeps; ++s) {
+        for (int color = 0; color < 2; ++color) {
+            if (strided) {
+                map(update, make_range(dim_fancy<int, 2>(1, N - 1), dim_fancy<int, 2>(1 + color, N - 1)),
+                    map_sched::parallel<>());
+                map(update, make_range(dim_fancy<int, 2>(2, N - 1), dim_fancy<int, 2>(2 - color, N - 1)),
+                    map_sched::parallel<>());
+            } else {
+                map([&](int i)
+                    {
+                        for (int j = 1 + (i + 1 + color) % 2; j < int(N) - 1; j += 2) {
+                            update(i, j);
+                        }
+                    },
+                    make_range(dim<int>(1, N - 1)),
+                    map_sched::parallel<>());
+            }
+        }
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t Order, size_t N>
+void test_stencil_redblack()
+{
+    static const size_t Sweeps = 10;
+
+    dynarray<data_type, 2> x(N, N), y(N, N);
+
+    std::cout << "R:" << Order << "_" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_redblack_instance<N>(y, Sweeps, false);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_redblack_instance<N>(x, Sweeps, true);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(x == y);
+    }
+
+    std::cout << std::endl;
+}
+
+// Sweeps that only update the active cells (about 1 in 20): a map over the whole grid that checks a
+// flag vs a map over the compacted active cells, which is built once and reused in every sweep
+template <size_t N>
+size_t test_stencil_masked_instance(dynarray<data_type, 2> &x, size_t sweeps, bool masked)
+{
+    my_time_point start, end;
+
+    dynarray<char, 2> flag(N, N);
+
+    map([&](int i, int j)
+        {
+            x(i, j)    = data_type((i * 7 + j * 3) % 11);
+            flag(i, j) = i > 0 && i < int(N) - 1 && j > 0 && j < int(N) - 1 && (i * 13 + j * 29) % 20 == 0;
+        },
+        make_range(N, N));
+
+    auto update = [&](int i, int j)
+                  {
+                      x(i, j) = (x(i - 1, j) + x(i + 1, j) + x(i, j - 1) + x(i, j + 1)) / 4;
+                  };
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    if (masked) {
+        active_set<range<2>> active([&](int i, int j) { return flag(i, j) != 0; }, make_range(N, N));
+
+        for (size_t s = 0; s < sweeps; ++s) {
+            map_masked(update, active, map_sched::parallel<>());
+        }
+    } else {
+        for (size_t s = 0; s < sweeps; ++s) {
+            map([&](int i, int j)
+                {
+                    if (flag(i, j)) update(i, j);
+                },
+                make_range(N, N),
+                map_sched::parallel<>());
+        }
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t Order, size_t N>
+void test_stencil_masked()
+{
+    static const size_t Sweeps = 10;
+
+    dynarray<data_type, 2> x(N, N), y(N, N);
+
+    std::cout << "M:" << Order << "_" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_masked_instance<N>(y, Sweeps, false);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_masked_instance<N>(x, Sweeps, true);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(x == y);
+    }
+
+    std::cout << std::endl;
+}
+
+// Jacobi iterations with the residual computed by a separate reduce, and fused into the update
+template <int Order, size_t N, bool Fused>
+size_t test_stencil_residual_instance(pingpong<array<data_type[N][N]>> &x, size_t steps, double &residual)
+{
+    typedef array<data_type[N][N]> array_type;
+
+    my_time_point start, end;
+
+    map([&](int i, int j)
+        {
+            x.get()(i, j) = (N * i + j + 1) % 1024;
+        },
+        make_range(N, N));
+
+    auto f = [](const array_type &in, int i, int j) -> data_type
+             {
+                 data_type tmp = in(i, j);
+                 for (int k = 1; k <= Order; ++k) {
+                     tmp += in(i - k, j) + in(i + k, j) +
+                            in(i, j - k) + in(i, j + k);
+                 }
+                 return tmp / (4 * Order + 1);
+             };
+    auto interior = make_range(dim<int>(Order, int(N) - Order),
+                               dim<int>(Order, int(N) - Order));
+
+    fill_cache();
+
+    start = my_clock::now();
+
+    if (Fused) {
+        residual = iterate_until(x, f, interior, steps, 0.0, reduce_sched::parallel<>()).residual;
+    } else {
+        x.sync();
+        for (size_t step = 0; step < steps; ++step) {
+            const array_type &in = x.get();
+            array_type &out      = x.get_next();
+
+            map([&](int i, int j)
+                {
+                    out(i, j) = f(in, i, j);
+                },
+                interior,
+                map_sched::parallel<>());
+
+            residual = std::sqrt(reduce([&](int i, int j) -> double
+                                        {
+                                            double diff = double(out(i, j)) - double(in(i, j));
+                                            return diff * diff;
+                                        },
+                                        reduce_ops<double>::add,
+                                        interior,
+                                        reduce_sched::parallel<>()));
+            x.swap();
+        }
+    }
+
+    end = my_clock::now();
+
+    return microsecond_cast(end - start).count();
+}
+
+template <size_t Order, size_t N>
+void test_stencil_residual()
+{
+    static const size_t Steps = 8;
+
+    pingpong<array<data_type[N][N]>> x, y;
+    double res_x = 0, res_y = 0;
+
+    std::cout << "J:" << Order << "_" << N << ",";
+
+    std::vector<size_t> usecs(Iterations);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_residual_instance<Order, N, false>(x, Steps, res_x);
+    }
+    print_stats(usecs);
+
+    for (unsigned it = 0; it < Iterations; ++it) {
+        usecs[it] = test_stencil_residual_instance<Order, N, true>(y, Steps, res_y);
+    }
+    std::cout << ","; print_stats(usecs);
+
+    if (DoTest) {
+        assert(x.get() == y.get());
+        assert(std::fabs(res_x - res_y) <= 1e-6 * res_x);
+    }
+
+    std::cout << std::endl;
+}
+
 template <size_t Order, size_t N>
 void test_stencil_boost()
 {
@@ -335,6 +941,13 @@ void test_instance()
     test_stencil_static<Order, N>();
     test_stencil<Order, N>();
     test_stencil_dyn<Order, N>();
+    test_stencil_precision<Order, N>();
+    test_stencil_blocking<Order, N>();
+    test_stencil_spec<Order, N>();
+    test_stencil_residual<Order, N>();
+    test_stencil_curve<Order, N>();
+    if (Order == 1) test_stencil_redblack<Order, N>();
+    if (Order == 1) test_stencil_masked<Order, N>();
 #if 0
     test_stencil_boost<Order, N>();
 #endif
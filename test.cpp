@@ -19,14 +19,37 @@
  * }}}
  */
 
+#include <atomic>
 #include <chrono>
+#include <future>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <system_error>
 
 #include <map-reduce/map>
 #include <map-reduce/array>
+#include <map-reduce/async>
+#include <map-reduce/batch>
+#include <map-reduce/convolution>
+#include <map-reduce/curve>
 #include <map-reduce/dynarray>
+#include <map-reduce/expr>
+#include <map-reduce/graph>
+#include <map-reduce/io>
+#include <map-reduce/iterate>
+#include <map-reduce/masked>
+#include <map-reduce/pipeline>
+#include <map-reduce/ragged>
 #include <map-reduce/reduce>
+#include <map-reduce/soa>
+#include <map-reduce/gemm>
+#include <map-reduce/half>
+#include <map-reduce/sparse>
+#include <map-reduce/stencil>
+#include <map-reduce/stream>
+#include <map-reduce/transpose>
+#include <map-reduce/view>
 
 #include <boost/multi_array.hpp>
 
@@ -423,7 +446,8 @@ size_t test_matrixmul_dyn_instance(T &c, T &a, T &b, size_t N, size_t M)
 
 enum class transpose_impl {
     pure,
-    map
+    map,
+    library
 };
 
 template <transpose_impl Impl, typename T, size_t N, size_t M, bool Test = false>
@@ -458,6 +482,10 @@ size_t test_transpose_static_instance(T &a, T &b)
             make_range(N, M));
     }
 
+    if (Impl == transpose_impl::library) {
+        transpose_inplace(&a[0][0], N, M);
+    }
+
     end = std::chrono::system_clock::now();
 
     return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
@@ -499,6 +527,18 @@ size_t test_transpose_dyn_instance(T &a, T &b, size_t N, size_t M)
         assert(a == b);
     }
 
+    if (Impl == transpose_impl::library || Test) {
+        transpose_inplace(&a[0][0], N, M);
+    }
+
+    if (Test) {
+        map([&](int i, int j)
+            {
+                assert(a[i][j] == b[j][i]);
+            },
+            make_range(N, M));
+    }
+
     end = std::chrono::system_clock::now();
 
     return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
@@ -545,6 +585,9 @@ void test_transpose_static()
     usecs = test_transpose_static_instance<transpose_impl::map, long (&)[N][M], N, M>(a, b);
     std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
 
+    usecs = test_transpose_static_instance<transpose_impl::library, long (&)[N][M], N, M>(a, b);
+    std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
+
     delete [] &a;
     delete [] &b;
 }
@@ -585,6 +628,9 @@ void test_transpose()
 
     usecs = test_transpose_static_instance<transpose_impl::map, array<long[N][M]>, N, M>(a, b);
     std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
+
+    usecs = test_transpose_static_instance<transpose_impl::library, array<long[N][M]>, N, M>(a, b);
+    std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
 }
 
 void test_matrixmul_dyn()
@@ -626,6 +672,11 @@ void test_transpose_dyn()
 
     usecs = test_transpose_dyn_instance<transpose_impl::map, array_type>(a, b, N, M);
     std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
+
+    usecs = test_transpose_dyn_instance<transpose_impl::library, array_type>(a, b, N, M);
+    std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
+
+    test_transpose_dyn_instance<transpose_impl::library, array_type, true>(a, b, N, M);
 }
 
 void test_matrixmul_boost()
@@ -668,6 +719,9 @@ void test_transpose_boost()
 
     test_transpose_dyn_instance<transpose_impl::map, array_type>(a, b, N, M);
     std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
+
+    usecs = test_transpose_dyn_instance<transpose_impl::library, array_type>(a, b, N, M);
+    std::cout << "1000x1000: " << usecs << " usecs " << std::endl;
 }
 
 void test_array()
@@ -708,18 +762,1805 @@ void test_dynarray()
     }
 }
 
-void test_ref()
+template <typename Layout>
+void test_dynarray_layout_instance()
 {
-    array<int[10][1]> a;
-    array_ref<int[10][1]> a_ref(a);
-    array_ref<int[1][10]> b_ref(a.reshape<int[1][10]>());
+    dynarray<int, 3, Layout> a(3, 19, 13);
+
+    map([&](int i, int j, int k)
+        {
+            a(i, j, k) = (i * 19 + j) * 13 + k;
+        },
+        make_range(3, 19, 13));
+
+    for (unsigned i = 0; i < a.get_size(0); ++i) {
+        for (unsigned j = 0; j < a.get_size(1); ++j) {
+            for (unsigned k = 0; k < a.get_size(2); ++k) {
+                assert(a(i, j, k) == int((i * 19 + j) * 13 + k));
+            }
+        }
+    }
+}
+
+void test_dynarray_layout()
+{
+    test_dynarray_layout_instance<layout_row_major>();
+    test_dynarray_layout_instance<layout_col_major>();
+    test_dynarray_layout_instance<layout_tiled<>>();
+    test_dynarray_layout_instance<layout_tiled<4, 16>>();
+
+    dynarray<int, 2, layout_col_major> c(10, 7);
+    c(3, 5) = 1;
+    assert(c.data()[3 + 5 * 10] == 1);
+
+    // 16 x 16 tiles of 4 x 4 elements
+    dynarray<int, 2, layout_tiled<4>> t(13, 13);
+    t(6, 9) = 1;
+    assert(t.data()[(1 * 4 + 2) * 16 + 2 * 4 + 1] == 1);
+}
+
+void test_dynarray_extents()
+{
+    static const size_t N = 17;
+    static const size_t M = 23;
+
+    using layout = extents<dynamic_extent, dynamic_extent, 4>;
+    static_assert(layout::get_extent<2>() == 4, "Static extent expected");
+
+    dynarray<float, 3, layout> a(N, M, 4);
+    dynarray<float, 3> b(N, M, 4);
+
+    map([&](int i, int j)
+        {
+            for (unsigned c = 0; c < layout::get_extent<2>(); ++c) {
+                a(i, j, c) = float((i * M + j) * 4 + c);
+                b(i, j, c) = float((i * M + j) * 4 + c);
+            }
+        },
+        make_range(N, M));
+
+    assert(std::equal(a.data(), a.data() + N * M * 4, b.data()));
+    assert(a[N - 1][M - 1][3] == b(N - 1, M - 1, 3));
+}
+
+#define PARTICLE_FIELDS(F) F(float, x) F(float, y) F(float, vx) F(float, vy) F(int, id)
+SOA_RECORD(particle, PARTICLE_FIELDS)
+
+struct huge_field {
+    char bytes[1 << 26];
+};
+
+#define LOPSIDED_FIELDS(F) F(char, small) F(huge_field, huge)
+SOA_RECORD(lopsided, LOPSIDED_FIELDS)
+
+void test_soa()
+{
+    static const size_t N = 1001;
+
+    soa_array<particle> p(N);
+
+    assert(size_t(p.columns().x)  % SoaAlignment == 0);
+    assert(size_t(p.columns().id) % SoaAlignment == 0);
+
+    map([&](int i)
+        {
+            particle init;
+            init.x  = float(i);
+            init.y  = 0.f;
+            init.vx = 1.f;
+            init.vy = float(i % 2);
+            init.id = i;
+
+            p(i) = init;
+        },
+        make_range(N));
+
+    map([&](int i)
+        {
+            p(i).x += p(i).vx;
+            p(i).y += p(i).vy;
+        },
+        make_range(N));
+
+    float sum = reduce_sum([&](int i)
+                           {
+                               return p(i).x;
+                           },
+                           make_range(N));
+    assert(sum == float(N * (N + 1) / 2));
+
+    int odd = reduce_sum([&](int i)
+                         {
+                             return int(p(i).y);
+                         },
+                         make_range(N));
+    assert(odd == int(N / 2));
+
+    const soa_array<particle> &c = p;
+    particle last = c(N - 1);
+    assert(last.id == int(N - 1) && last.x == float(N));
+
+    soa_array<particle, 2> q(4, 5);
+    q(3, 4).id = 7;
+    assert(q.columns().id[3 * 5 + 4] == 7);
+
+    // The second column cannot be allocated: the first one is released and the exception propagated
+    bool caught = false;
+    try {
+        soa_array<lopsided> l(size_t(1) << 24);
+    } catch (const std::bad_alloc &) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+void test_sparse()
+{
+    static const size_t N = 97;
+    static const size_t M = 61;
+
+    dynarray<long, 2> a(N, M);
+    map([&](int i, int j)
+        {
+            a(i, j) = (i * 7 + j * 3) % 11 == 0? i + j + 1: 0;
+        },
+        make_range(N, M));
+
+    csr_array<long> s(N, M, [&](int i, int j)
+                            {
+                                return a(i, j);
+                            });
+
+    long dense_sum = reduce_sum([&](int i, int j)
+                                {
+                                    return a(i, j);
+                                },
+                                make_range(N, M));
+
+    long sparse_sum = reduce_nonzeros([&](int i, int j, long v)
+                                      {
+                                          assert(a(i, j) == v);
+                                          return v;
+                                      },
+                                      reduce_ops<long>::add,
+                                      s,
+                                      reduce_sched::parallel<>());
+    assert(sparse_sum == dense_sum);
+
+    // Chunks are combined in order: a non-commutative operator gives the same result as the serial reduce
+    auto last = [](long, long y) { return y; };
+    auto position = [](int i, int j, long) { return long(i) * 100000 + j; };
+    assert(reduce_nonzeros(position, last, s, reduce_sched::parallel<>()) == reduce_nonzeros(position, last, s));
+
+    map_nonzeros([&](int i, int j, long &v)
+                 {
+                     v *= 2;
+                 },
+                 s,
+                 map_sched::parallel<>());
+
+    array<long[M]> x;
+    array<long[N]> y;
+    map([&](int j)
+        {
+            x[j] = j % 5;
+        },
+        make_range(M));
+
+    spmv(y, s, x, map_sched::parallel<>());
+
+    for (unsigned i = 0; i < N; ++i) {
+        long gold = 0;
+        for (unsigned j = 0; j < M; ++j) {
+            gold += 2 * a(i, j) * x[j];
+        }
+        assert(y[i] == gold);
+    }
+
+    coo_array<long> coo(3, 3);
+    coo.push(2, 1, 5);
+    coo.push(0, 2, 1);
+    coo.push(2, 1, 2);
+    csr_array<long> c(coo);
+    assert(c.nnz() == 2 && c.row_begin(2) == 1 && c.col(1) == 1 && c.value(1) == 7);
+}
+
+void test_half()
+{
+    // Every finite half converts to float and back unchanged, with and without F16C
+    for (unsigned bits = 0; bits < 0x10000; ++bits) {
+        float f = half_to_float_soft(uint16_t(bits));
+        assert(half::from_bits(uint16_t(bits)) == f || f != f);
+        if (f == f) {
+            assert(half_from_float_soft(f) == bits);
+            assert(half(f).bits() == bits);
+        }
+    }
+
+    // Ties round to even, overflow saturates to Inf and tiny values flush to zero
+    assert(half(1.f + 1.f / 2048).bits() == 0x3c00);
+    assert(half(1.f + 3.f / 2048).bits() == 0x3c02);
+    assert(half(65520.f).bits() == 0x7c00);
+    assert(half(1e-8f).bits() == 0x0000);
+    assert(bfloat16(1.f + 1.f / 256).bits() == 0x3f80);
+    assert(bfloat16(-2.5f) == -2.5f);
+
+    static const size_t N = 300;
+    static const size_t M = 70;
+
+    dynarray<half, 2>     a(N, M);
+    dynarray<bfloat16, 2> b(N, M);
+    map([&](int i, int j)
+        {
+            a(i, j) = float((i * M + j) % 512) / 64;
+            b(i, j) = float((i * M + j) % 512) / 64;
+        },
+        make_range(N, M));
+
+    float gold = 0;
+    for (unsigned i = 0; i < N; ++i) {
+        for (unsigned j = 0; j < M; ++j) {
+            gold += float((i * M + j) % 512) / 64;
+        }
+    }
+
+    // Values are multiples of 1/64 below 8, exact in both formats
+    float sum_a = reduce_sum([&](int i, int j)
+                             {
+                                 return float(a(i, j));
+                             },
+                             make_range(N, M));
+    float sum_b = reduce_sum([&](int i, int j)
+                             {
+                                 return float(b(i, j));
+                             },
+                             make_range(N, M));
+    assert(sum_a == gold && sum_b == gold);
+
+    std::vector<float> row(M);
+    std::vector<half>  row_h(M);
+    widen(&row[0], &a(1, 0), M);
+    narrow(&row_h[0], &row[0], M);
+    for (unsigned j = 0; j < M; ++j) {
+        assert(row[j] == a(1, j) && row_h[j].bits() == a(1, j).bits());
+    }
+}
+
+void test_copy()
+{
+    // Sizes below and above the parallel and the non-temporal thresholds, misaligned on purpose
+    static const size_t Sizes[] = { 0, 1, 63, CopyParallelBytes + 5, CopyStreamBytes + 4099 };
+
+    std::vector<char> src(CopyStreamBytes + 4099 + 3);
+    std::vector<char> dst(CopyStreamBytes + 4099 + 3);
+    for (size_t i = 0; i < src.size(); ++i) {
+        src[i] = char(i * 31 + 7);
+    }
+
+    for (size_t bytes : Sizes) {
+        std::fill(dst.begin(), dst.end(), 0);
+        bulk_copy(&dst[3], &src[1], bytes);
+        assert(::memcmp(&dst[3], &src[1], bytes) == 0);
+        assert(dst[2] == 0 && dst[3 + bytes] == 0);
+    }
+
+    static const size_t N = 2048;
+
+    array<float[N][N]> a;
+    map([&](int i, int j)
+        {
+            a[i][j] = float(i * N + j);
+        },
+        make_range(N, N));
+
+    array<float[N][N]> b(a);
+    assert(a == b);
+
+    cow_array<float[N][N]> c(a);
+    cow_array<float[N][N]> d(c);
+    const cow_array<float[N][N]> &d_const = d;
+
+    // Reads do not copy
+    assert(d.shared() && c.shared());
+    assert(d_const[3][5] == a[3][5] && d_const.data() == static_cast<const cow_array<float[N][N]> &>(c).data());
+
+    // The first write detaches
+    d(3, 5) = -1.f;
+    assert(!d.shared() && !c.shared());
+    assert(d_const[3][5] == -1.f && c(3, 5) == a[3][5]);
+    assert(!(c == d));
+
+    // Writers detach once, and then write without checking, also from parallel code
+    cow_array<float[N][N]> e(c);
+    assert(e.shared());
+    auto w = e.writer();
+    assert(!e.shared() && !c.shared());
+    map([&](int i, int j)
+        {
+            w(i, j) = -w(i, j);
+        },
+        make_range(N, N),
+        map_sched::parallel<>());
+    assert(w[7][9] == -a[7][9] && e(7, 9) == -a[7][9] && c(7, 9) == a[7][9]);
+}
+
+void test_alloc()
+{
+    static const size_t N = 300;
+    static const size_t M = 200;
+
+    using pool_type    = dynarray<float, 2, layout_row_major, alloc_pool>;
+    using scratch_type = dynarray<float, 2, layout_row_major, alloc_scratch>;
+
+    size_t allocs = 0;
+    size_t chunks = 0;
+
+    for (unsigned it = 0; it < 4; ++it) {
+        pool_type a(N, M);
+        pool_type b(N, M);
+        array<float[N], alloc_pool> c;
+
+        map([&](int i, int j)
+            {
+                a(i, j) = float(i + j + it);
+            },
+            make_range(N, M));
+
+        // Per-thread scratch rows inside the body
+        map([&](int i)
+            {
+                scratch_scope scope;
+                float *row = scratch<float>(M);
+                for (unsigned j = 0; j < M; ++j) {
+                    row[j] = 2 * a(i, j);
+                }
+                for (unsigned j = 0; j < M; ++j) {
+                    b(i, j) = row[M - 1 - j];
+                }
+                c[i] = b(i, 0);
+            },
+            make_range(N),
+            map_sched::parallel<>());
+
+        // Scratch arrays are released in reverse order of creation
+        scratch_type d(N, M);
+        scratch_type e(M, N);
+        assert(&e(0, 0) == &d(0, 0) + N * M);
+        map([&](int i, int j)
+            {
+                e(j, i) = b(i, j);
+            },
+            make_range(N, M));
+        assert(e(M - 1, 0) == 2 * a(0, 0) && c[N - 1] == 2 * a(N - 1, M - 1));
+
+        // After the first iteration every allocation is served from the pool and the arenas
+        if (it == 0) {
+            allocs = block_pool::get().get_system_allocs();
+            chunks = scratch_arena::get().get_chunks();
+        } else {
+            assert(block_pool::get().get_system_allocs() == allocs);
+            assert(scratch_arena::get().get_chunks() == chunks);
+        }
+    }
+
+    assert(scratch_arena::get().get_mark().chunk == 0 && scratch_arena::get().get_mark().top == 0);
+}
+
+void test_gemm()
+{
+    // Sizes that are not multiples of the register and cache blocks
+    static const size_t M = 101;
+    static const size_t N = 67;
+    static const size_t K = 300;
+
+    dynarray<long, 2> a(M, K);
+    dynarray<long, 2, layout_col_major> b(K, N);
+    dynarray<long, 2> c(M, N);
+    array<long[M][N]> c_array;
+
+    map([&](int i, int k)
+        {
+            a(i, k) = (i * 3 + k) % 7 - 3;
+        },
+        make_range(M, K));
+    map([&](int k, int j)
+        {
+            b(k, j) = (k + j * 5) % 5 - 2;
+        },
+        make_range(K, N));
+
+    gemm(c, a, b, M, N, K, map_sched::parallel<>());
+    gemm(c_array, a, b, M, N, K);
+
+    for (unsigned i = 0; i < M; ++i) {
+        for (unsigned j = 0; j < N; ++j) {
+            long gold = 0;
+            for (unsigned k = 0; k < K; ++k) {
+                gold += a(i, k) * b(k, j);
+            }
+            assert(c(i, j) == gold && c_array[i][j] == gold);
+        }
+    }
+}
+
+void test_stencil_blocking()
+{
+    static const int Order = 2;
+    static const size_t N = 70;
+    static const size_t M = 90;
+    static const size_t Steps = 10;
+
+    auto kernel = [](const stencil_grid<long> &in, int i, int j) -> long
+                  {
+                      long tmp = in(i, j);
+                      for (int k = 1; k <= Order; ++k) {
+                          tmp += in(i - k, j) + in(i + k, j) +
+                                 in(i, j - k) + in(i, j + k);
+                      }
+                      return tmp / (4 * Order + 1);
+                  };
+
+    dynarray<long, 2> gold(N, M), gold_tmp(N, M);
+    map([&](int i, int j)
+        {
+            gold(i, j) = (i * 37 + j * 101) % 1000;
+        },
+        make_range(N, M));
+
+    for (size_t t = 0; t < Steps; ++t) {
+        for (unsigned i = 0; i < N; ++i) {
+            for (unsigned j = 0; j < M; ++j) {
+                bool interior = i >= Order && i < N - Order && j >= Order && j < M - Order;
+                gold_tmp(i, j) = interior? kernel(stencil_grid<long>(&gold(0, 0), 0, 0, M), i, j): gold(i, j);
+            }
+        }
+        std::swap_ranges(&gold_tmp(0, 0), &gold_tmp(0, 0) + N * M, &gold(0, 0));
+    }
+
+    // One step per pass, and time tiles that do not divide the grid nor the number of steps
+    static const stencil_tiling Tilings[] = { stencil_tiling(1), stencil_tiling(3, 16, 20), stencil_tiling(4, 7, 11) };
+
+    for (const stencil_tiling &tiling : Tilings) {
+        dynarray<long, 2> a(N, M), b(N, M);
+        map([&](int i, int j)
+            {
+                a(i, j) = (i * 37 + j * 101) % 1000;
+            },
+            make_range(N, M));
+
+        subarray<long, 2, 2> &res = stencil_iterate<Order>(a, b, Steps, kernel, tiling, map_sched::parallel<>());
+        assert(&res == &a || &res == &b);
+        assert(res == gold);
+    }
+}
+
+void test_stencil_spec()
+{
+    static const int N = 37;
+    static const int M = 53;
+
+    using laplace = stencil_spec<stencil_point< 0,  0, -4>,
+                                 stencil_point<-1,  0>, stencil_point<1, 0>,
+                                 stencil_point< 0, -1>, stencil_point<0, 1>>;
+    using star = stencil_star<2>::type;
+    static_assert(laplace::radius == 1 && laplace::points == 5, "Wrong laplace stencil");
+    static_assert(star::radius == 2 && star::points == 9, "Wrong star stencil");
+
+    dynarray<long, 2> a(N, M), b(N, M);
+    array<long[N][M]> c, d;
+    map([&](int i, int j)
+        {
+            a(i, j) = c[i][j] = (i * 13 + j * 7) % 31;
+        },
+        make_range(N, M));
+
+    auto get = [&](int i, int j, stencil_boundary boundary) -> long
+               {
+                   if (i >= 0 && i < N && j >= 0 && j < M) return a(i, j);
+                   if (boundary == stencil_boundary::zero) return 0;
+                   if (boundary == stencil_boundary::clamp) {
+                       return a(std::min(std::max(i, 0), N - 1), std::min(std::max(j, 0), M - 1));
+                   }
+                   return a((i + N) % N, (j + M) % M);
+               };
+
+    static const stencil_boundary Boundaries[] = { stencil_boundary::copy, stencil_boundary::zero,
+                                                   stencil_boundary::clamp, stencil_boundary::periodic };
+    for (stencil_boundary boundary : Boundaries) {
+        stencil_apply<laplace>(b, a, boundary, map_sched::parallel<>());
+
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < M; ++j) {
+                bool edge = i < 1 || i >= N - 1 || j < 1 || j >= M - 1;
+                long gold = (boundary == stencil_boundary::copy && edge)? a(i, j):
+                            -4 * get(i, j, boundary) + get(i - 1, j, boundary) + get(i + 1, j, boundary) +
+                                                       get(i, j - 1, boundary) + get(i, j + 1, boundary);
+                assert(b(i, j) == gold);
+            }
+        }
+    }
+
+    // Same result as the hand-written order 2 stencil, for array and as a kernel of stencil_iterate
+    stencil_apply<star>(d, c);
+    for (int i = 2; i < N - 2; ++i) {
+        for (int j = 2; j < M - 2; ++j) {
+            long tmp = c[i][j];
+            for (int k = 1; k <= 2; ++k) {
+                tmp += c[i - k][j] + c[i + k][j] + c[i][j - k] + c[i][j + k];
+            }
+            assert(d[i][j] == tmp);
+        }
+    }
+
+    subarray<long, 2, 2> &res = stencil_iterate<star::radius>(a, b, 1, star(), stencil_tiling(1));
+    for (int i = 2; i < N - 2; ++i) {
+        for (int j = 2; j < M - 2; ++j) {
+            assert(res(i, j) == d[i][j]);
+        }
+    }
+}
+
+void test_convolution()
+{
+    static const int N = 45;
+    static const int M = 61;
+    static const int K = 5;
+    static const int R = K / 2;
+
+    dynarray<long, 2> a(N, M), b(N, M), gold(N, M);
+    dynarray<long, 2> sep(K, K), nonsep(K, K);
+
+    static const long Col[K] = { 1, 2, 3, 2, 1 };
+    static const long Row[K] = { 1, -1, 0, 2, 1 };
+
+    map([&](int i, int j)
+        {
+            a(i, j) = (i * 13 + j * 7) % 31;
+        },
+        make_range(N, M));
+    map([&](int i, int j)
+        {
+            sep(i, j)    = Col[i] * Row[j];
+            nonsep(i, j) = i + j;
+        },
+        make_range(K, K));
+
+    std::vector<long> col, row;
+    assert(convolution_separate(sep, K, col, row));
+    assert(!convolution_separate(nonsep, K, col, row));
+
+    static const convolution_method Methods[] = { convolution_method::automatic, convolution_method::direct,
+                                                  convolution_method::separable, convolution_method::fft };
+
+    for (const dynarray<long, 2> *kernel : { &nonsep, &sep }) {
+        for (int i = R; i < N - R; ++i) {
+            for (int j = R; j < M - R; ++j) {
+                long tmp = 0;
+                for (int k1 = 0; k1 < K; ++k1) {
+                    for (int k2 = 0; k2 < K; ++k2) {
+                        tmp += (*kernel)(k1, k2) * a(i - R + k1, j - R + k2);
+                    }
+                }
+                gold(i, j) = tmp;
+            }
+        }
+
+        for (convolution_method method : Methods) {
+            if (method == convolution_method::separable && kernel == &nonsep) continue;
+
+            map([&](int i, int j)
+                {
+                    b(i, j) = -1;
+                },
+                make_range(N, M));
+
+            convolution_method used = convolve(b, a, N, M, *kernel, K, method, map_sched::parallel<>());
+            if (method == convolution_method::automatic) {
+                assert(used == (kernel == &sep? convolution_method::separable: convolution_method::direct));
+            } else {
+                assert(used == method);
+            }
+
+            for (int i = 0; i < N; ++i) {
+                for (int j = 0; j < M; ++j) {
+                    bool edge = i < R || i >= N - R || j < R || j >= M - R;
+                    assert(b(i, j) == (edge? -1: gold(i, j)));
+                }
+            }
+        }
+    }
+
+    // Explicit factors of sep (gold still holds its result), and floating-point data in an array
+    array<float[N][M]> c, d;
+    map([&](int i, int j)
+        {
+            c[i][j] = float(a(i, j)) * 0.5f;
+        },
+        make_range(N, M));
+
+    std::vector<float> fcol(Col, Col + K), frow(Row, Row + K);
+    convolve_separable(d, c, N, M, fcol, frow, K);
+    for (int i = R; i < N - R; ++i) {
+        for (int j = R; j < M - R; ++j) {
+            assert(d[i][j] == float(gold(i, j)) * 0.5f);
+        }
+    }
+
+    assert(convolution_cost(convolution_method::fft, 4096, 4096, 33) <
+           convolution_cost(convolution_method::direct, 4096, 4096, 33));
+}
+
+void test_iterate()
+{
+    static const int N = 24;
+    static const int M = 32;
+    static const size_t MaxSteps = 10000;
+
+    using grid = array<double[N][M]>;
+
+    // Laplace equation with the top edge at 1
+    grid init;
+    map([&](int i, int j)
+        {
+            init(i, j) = i == 0? 1.0: 0.0;
+        },
+        make_range(N, M));
+    grid gold(init);
+
+    auto jacobi = [](const grid &in, int i, int j) -> double
+                  {
+                      return (in(i - 1, j) + in(i + 1, j) + in(i, j - 1) + in(i, j + 1)) / 4;
+                  };
+    auto interior = make_range(dim<int>(1, N - 1), dim<int>(1, M - 1));
+
+    pingpong<grid> x(std::move(init));
+
+    // Swapping moves the storage, it does not copy it
+    double *curr = x.get().data();
+    double *next = x.get_next().data();
+    x.swap();
+    assert(x.get().data() == next && x.get_next().data() == curr);
+    x.swap();
+
+    iterate_status status = iterate_until(x, jacobi, interior, MaxSteps, 1e-6, reduce_sched::parallel<>());
+    assert(status.steps > 1 && status.steps < MaxSteps);
+    assert(status.residual < 1e-6);
+
+    // Same steps with a separate update and residual
+    grid tmp(gold);
+    double residual = 0;
+    for (size_t step = 0; step < status.steps; ++step) {
+        map([&](int i, int j)
+            {
+                tmp(i, j) = jacobi(gold, i, j);
+            },
+            interior);
+        residual = std::sqrt(reduce_sum([&](int i, int j) -> double
+                                        {
+                                            return (tmp(i, j) - gold(i, j)) * (tmp(i, j) - gold(i, j));
+                                        },
+                                        interior));
+        std::swap(gold, tmp);
+    }
+    assert(x.get() == gold);
+    assert(std::fabs(residual - status.residual) <= 1e-12);
+
+    // Fixed number of steps
+    status = iterate_until(x, jacobi, interior, 3, 0.0);
+    assert(status.steps == 3);
+
+    // 1-D and 3-D ranges. Fixed ends at 1 and 0 converge to a line
+    typedef array<double[33]> line;
+    line l0;
+    map([&](int i) { l0(i) = i == 0? 1.0: 0.0; }, make_range(33));
+    pingpong<line> l(std::move(l0));
+    status = iterate_until(l, [](const line &in, int i) { return (in(i - 1) + in(i + 1)) / 2; },
+                           make_range(dim<int>(1, 32)), 100000, 1e-12, reduce_sched::parallel<>());
+    assert(status.residual < 1e-12 && std::fabs(l.get()(8) - 0.75) < 1e-6);
+
+    typedef array<double[6][6][6]> cube;
+    cube c0;
+    map([&](int i, int j, int k) { c0(i, j, k) = i + j * k; }, make_range(6, 6, 6));
+    pingpong<cube> c(std::move(c0));
+    auto smooth = [](const cube &in, int i, int j, int k)
+                  {
+                      return (in(i - 1, j, k) + in(i + 1, j, k) + in(i, j - 1, k) + in(i, j + 1, k) +
+                              in(i, j, k - 1) + in(i, j, k + 1)) / 6;
+                  };
+    status = iterate_until(c, smooth, make_range(dim<int>(1, 5), dim<int>(1, 5), dim<int>(1, 5)), 1, 0.0);
+    // Neighbors of (2, 3, 4): 13 + 15 + 10 + 18 + 11 + 17
+    assert(status.steps == 1 && c.get()(2, 3, 4) == 14.0);
+}
+
+template <typename T>
+void test_transpose_library_instance(size_t N, size_t M)
+{
+    dynarray<T, 2> a(N, M), b(M, N);
+
+    map([&](int i, int j)
+        {
+            a(i, j) = T(i * M + j);
+        },
+        make_range(N, M));
+
+    transpose(b, a, map_sched::parallel<>());
+    map([&](int i, int j)
+        {
+            assert(b(j, i) == a(i, j));
+        },
+        make_range(N, M));
+
+    if (N == M) {
+        transpose_inplace(a, map_sched::parallel<>());
+        assert(a == b);
+    }
+}
+
+void test_transpose_library()
+{
+    // Element sizes with and without in-register transposes, and sizes that are not multiple of the blocks
+    test_transpose_library_instance<float>(300, 517);
+    test_transpose_library_instance<long>(517, 300);
+    test_transpose_library_instance<short>(129, 70);
+    test_transpose_library_instance<float>(301, 301);
+    test_transpose_library_instance<double>(513, 513);
+    test_transpose_library_instance<char>(37, 37);
+
+    array<long[37][53]> a;
+    array<long[53][37]> b;
+    map([&](int i, int j)
+        {
+            a(i, j) = i * 53 + j;
+        },
+        make_range(37, 53));
+
+    transpose(b, a);
+    map([&](int i, int j)
+        {
+            assert(b(j, i) == a(i, j));
+        },
+        make_range(37, 53));
+}
+
+template <typename Layout>
+void test_batch_instance()
+{
+    // Not a multiple of the chunks
+    static const size_t B = 3 * BatchChunk + 5;
+    static const size_t N = 4;
+    static const size_t M = 3;
+    static const size_t K = 5;
+
+    dynarray<long, 3, Layout> a(B, N, K), b(B, K, M), c(B, N, M), t(B, K, N);
+    dynarray<long, 2, Layout> x(B, K), y(B, N);
+
+    map([&](int m, int i, int k)
+        {
+            a(m, i, k) = (m * 7 + i * 3 + k) % 13 - 6;
+        },
+        make_range(B, N, K));
+    map([&](int m, int k, int j)
+        {
+            b(m, k, j) = (m * 5 + k * 2 + j) % 11 - 5;
+        },
+        make_range(B, K, M));
+    map([&](int m, int k)
+        {
+            x(m, k) = m % 7 - k;
+        },
+        make_range(B, K));
+
+    batch_gemm<N, M, K>(c, a, b, map_sched::parallel<>());
+    batch_gemv<N, K>(y, a, x);
+    batch_transpose<N, K>(t, a);
+
+    for (size_t m = 0; m < B; ++m) {
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j < M; ++j) {
+                long tmp = 0;
+                for (size_t k = 0; k < K; ++k) {
+                    tmp += a(m, i, k) * b(m, k, j);
+                }
+                assert(c(m, i, j) == tmp);
+            }
+
+            long tmp = 0;
+            for (size_t k = 0; k < K; ++k) {
+                tmp += a(m, i, k) * x(m, k);
+                assert(t(m, k, i) == a(m, i, k));
+            }
+            assert(y(m, i) == tmp);
+        }
+    }
+}
+
+void test_batch()
+{
+    test_batch_instance<layout_row_major>();
+    test_batch_instance<layout_col_major>();
+}
+
+void test_expr()
+{
+    static const int N = 123;
+    static const int M = 77;
+
+    dynarray<long, 2> a(N, M), b(N, M), c(N, M);
+    array<long[N][M]> d, e;
+
+    map([&](int i, int j)
+        {
+            a(i, j) = (i * 13 + j * 7) % 31 - 15;
+            b(i, j) = (i * 5 + j * 3) % 17 - 8;
+            d(i, j) = i - j;
+        },
+        make_range(N, M));
+
+    // Nothing is computed until the assignment
+    auto ex = a * 2 + b;
+    static_assert(std::is_same<decltype(ex)::value_type, long>::value, "Wrong expression type");
+    assert(ex.size() == size_t(N * M));
+
+    c = ex;
+    e = clamp(-(d - a) / 2, -5L, 5L);
+    map([&](int i, int j)
+        {
+            assert(c(i, j) == a(i, j) * 2 + b(i, j));
+            assert(e(i, j) == std::min(std::max(-(d(i, j) - a(i, j)) / 2, -5L), 5L));
+        },
+        make_range(N, M));
+
+    // In place, and mixing array and dynarray
+    c = c * c - max(d, b);
+    map([&](int i, int j)
+        {
+            long tmp = a(i, j) * 2 + b(i, j);
+            assert(c(i, j) == tmp * tmp - std::max(d(i, j), b(i, j)));
+        },
+        make_range(N, M));
+
+    // Reductions read the expression directly
+    auto prod = a * b;
+    long dot = reduce_sum(prod, make_range(prod.size()));
+    long gold = 0;
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < M; ++j) {
+            gold += a(i, j) * b(i, j);
+        }
+    }
+    assert(dot == gold);
+
+    dynarray<float, 2> f(N, M);
+    assign(f, lazy(a) * 0.5f + 1, map_sched::parallel<>());
+    assert(f(3, 4) == a(3, 4) * 0.5f + 1);
+
+    // Column-major operands. Mixing layouts does not compile, and extents must match (not only sizes)
+    dynarray<long, 2, layout_col_major> g(N, M), h(N, M);
+    map([&](int i, int j) { g(i, j) = 10 * i + j; }, make_range(N, M));
+    h = g * 2 - 1;
+    assert(h(2, 3) == 45 && h(N - 1, 0) == 20 * (N - 1) - 1);
+    auto gh = g + h;
+    assert(gh.get_size(0) == size_t(N) && gh.get_size(1) == size_t(M));
+}
+
+void test_expr_pipeline()
+{
+    print_banner("Scale, add and clamp");
+
+    static const size_t N = 2048;
+    static const size_t M = 2048;
+
+    dynarray<float, 2> a(N, M), b(N, M), c(N, M), d(N, M);
+    map([&](int i, int j)
+        {
+            a(i, j) = float((i + j) % 100) / 50;
+            b(i, j) = float((i * j) % 100) / 100;
+        },
+        make_range(N, M));
+
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+
+    // One parallel pass per operation
+    start = std::chrono::system_clock::now();
+    map([&](int i, int j)
+        {
+            c(i, j) = a(i, j) * 2.f;
+        },
+        make_range(N, M),
+        map_sched::parallel<>());
+    map([&](int i, int j)
+        {
+            c(i, j) = c(i, j) + b(i, j);
+        },
+        make_range(N, M),
+        map_sched::parallel<>());
+    map([&](int i, int j)
+        {
+            c(i, j) = std::min(std::max(c(i, j), 0.5f), 3.f);
+        },
+        make_range(N, M),
+        map_sched::parallel<>());
+    end = std::chrono::system_clock::now();
+    std::cout << "2048x2048: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+              << " usecs " << std::endl;
+
+    // Fused, in a single parallel pass
+    start = std::chrono::system_clock::now();
+    d = clamp(a * 2.f + b, 0.5f, 3.f);
+    end = std::chrono::system_clock::now();
+    std::cout << "2048x2048: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+              << " usecs " << std::endl;
+
+    map([&](int i, int j)
+        {
+            assert(c(i, j) == d(i, j));
+        },
+        make_range(N, M));
+}
+
+void test_graph()
+{
+    static const int N = 200;
+    static const int M = 33;
+
+    dynarray<long, 2> a(N, M), b(N, M), c(N, M), d(N, M);
+    long sum = 0;
+
+    task_graph g;
+    g.name(a, "a");
+    g.name(c, "c");
+
+    g.map("init a", [&](int i, int j) { a(i, j) = i + j; }, make_range(N, M)).writes_tile(a);
+    g.map("init b", [&](int i, int j) { b(i, j) = i - j; }, make_range(N, M)).writes_tile(b);
+    // Pipelined with both initializations
+    g.map("add", [&](int i, int j) { c(i, j) = a(i, j) + b(i, j); }, make_range(N, M))
+        .reads_tile(a).reads_tile(b).writes_tile(c);
+    g.reduce("sum", [&](int i, int j) { return c(i, j); }, reduce_ops<long>::add, make_range(N, M), sum)
+        .reads_tile(c);
+    // Needs the whole reduce and reads rows of a that other tiles write
+    g.map("scale", [&](int i, int j) { d(i, j) = c(i, j) * sum + a(N - 1 - i, j); }, make_range(N, M))
+        .reads(sum).reads_tile(c).reads(a).writes_tile(d);
+    // Write after read: waits for "scale"
+    g.map("clear a", [&](int i, int j) { a(i, j) = 0; }, make_range(N, M)).writes_tile(a);
+
+    assert(g.size() == 6);
+    g.run();
+
+    long gold = 0;
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < M; ++j) {
+            gold += 2 * i;
+        }
+    }
+    assert(sum == gold);
+
+    map([&](int i, int j)
+        {
+            assert(a(i, j) == 0);
+            assert(c(i, j) == 2 * i);
+            assert(d(i, j) == 2 * i * gold + (N - 1 - i + j));
+        },
+        make_range(N, M));
+
+    std::ostringstream dot;
+    g.dump_dot(dot);
+    assert(dot.str().find("n0 -> n2 [label=\"a\", style=dashed]") != std::string::npos);
+    assert(dot.str().find("n3 -> n4 [label=\"") != std::string::npos);
+    assert(dot.str().find("n4 -> n5 [label=\"a\"]") != std::string::npos);
+    assert(dot.str().find("n0 -> n1") == std::string::npos);
+
+    std::ostringstream trace;
+    g.dump_trace(trace);
+    assert(trace.str().find("\"name\": \"scale\"") != std::string::npos);
+
+    // The graph can be run again
+    sum = 0;
+    g.run();
+    assert(sum == gold);
+
+    task_graph empty;
+    empty.run();
+
+    // Every element is visited once, also when an empty producer releases tiles that have no other
+    // dependences left
+    static const int R = 64;
+    std::vector<std::atomic<int>> visits(R * M);
+    long x = 0;
+    for (int it = 0; it < 20; ++it) {
+        for (std::atomic<int> &v : visits) v = 0;
+
+        task_graph p;
+        p.map("empty", [&](int) { x = 1; }, make_range(0)).writes(x);
+        p.map("after empty", [&](int i, int j) { ++visits[i * M + j]; }, make_range(R, M)).reads(x);
+        p.map("produce", [&](int i, int j) { b(i, j) = i * j; }, make_range(R, M)).writes_tile(b);
+        p.map("consume", [&](int i, int j) { visits[i * M + j] += b(i, j) == i * j? 2: 100; }, make_range(R, M))
+            .reads_tile(b);
+        p.run();
+
+        for (std::atomic<int> &v : visits) assert(v == 3);
+    }
+    assert(x == 0);
+}
+
+void test_async()
+{
+    static const int N = 1000;
+
+    std::vector<long> a(N), b(N);
+
+    auto init_a = map_async([&](int i) { a[i] = i; }, make_range(N));
+    auto init_b = map_async([&](int i) { b[i] = 2 * i; }, make_range(N), map_sched::parallel<>());
+
+    // Continuations run on the workers, and can wait on other futures
+    auto dot = init_a.then([&]()
+                           {
+                               init_b.wait();
+                               return reduce([&](int i) { return a[i] * b[i]; }, reduce_ops<long>::add, make_range(N));
+                           });
+    auto twice = dot.then([](long d) { return 2 * d; });
+
+    auto sum = init_a.then([&]()
+                           {
+                               return reduce_async([&](int i) { return a[i]; }, reduce_ops<long>::add,
+                                                   make_range(N)).get();
+                           });
+
+    long gold = 0;
+    for (long i = 0; i < N; ++i) {
+        gold += i * 2 * i;
+    }
+    assert(twice.get() == 2 * gold);
+    assert(dot.ready() && dot.get() == gold);
+    assert(sum.get() == long(N) * (N - 1) / 2);
+
+    // Exceptions are propagated through continuations
+    bool caught = false;
+    auto fail = async_call([]() -> int { throw std::runtime_error("async"); });
+    auto after = fail.then([](int v) { return v + 1; });
+    try {
+        after.get();
+    } catch (const std::runtime_error &) {
+        caught = true;
+    }
+    assert(caught);
+
+    // Many calls in flight
+    std::vector<async_future<long>> futures;
+    for (int k = 0; k < 100; ++k) {
+        futures.push_back(reduce_async([k](int i) { return long(i + k); }, reduce_ops<long>::add, make_range(10)));
+    }
+    for (int k = 0; k < 100; ++k) {
+        assert(futures[k].get() == 45 + 10 * k);
+    }
+}
+
+void test_async_calls()
+{
+    print_banner("Small asynchronous reduces");
+
+    static const int Calls = 2000;
+
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    long total = 0;
+
+    // One thread per call
+    start = std::chrono::system_clock::now();
+    {
+        std::vector<std::future<long>> futures;
+        for (int k = 0; k < Calls; ++k) {
+            futures.push_back(std::async(std::launch::async, [k]()
+                                         {
+                                             return reduce([k](int i) { return long(i ^ k); }, reduce_ops<long>::add,
+                                                           make_range(1000));
+                                         }));
+        }
+        for (std::future<long> &f : futures) {
+            total += f.get();
+        }
+    }
+    end = std::chrono::system_clock::now();
+    std::cout << "std::async: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+              << " usecs " << std::endl;
+
+    // Library workers
+    start = std::chrono::system_clock::now();
+    {
+        std::vector<async_future<long>> futures;
+        for (int k = 0; k < Calls; ++k) {
+            futures.push_back(reduce_async([k](int i) { return long(i ^ k); }, reduce_ops<long>::add,
+                                           make_range(1000)));
+        }
+        for (async_future<long> &f : futures) {
+            total -= f.get();
+        }
+    }
+    end = std::chrono::system_clock::now();
+    std::cout << "reduce_async: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+              << " usecs " << std::endl;
+
+    assert(total == 0);
+}
+
+void test_pipeline()
+{
+    static const size_t Elems  = 100000;
+    static const size_t Block  = 1024;
+
+    // The last block is partial
+    size_t produced = 0;
+    long sum = -1;
+    std::vector<size_t> order;
+
+    pipeline<long> p(Block, 2);
+    p.source([&](pipeline_block<long> &b)
+             {
+                 if (produced == Elems) return false;
+
+                 b.resize(std::min(Block, Elems - produced));
+                 for (size_t i = 0; i < b.size(); ++i) {
+                     b[i] = long(produced + i);
+                 }
+                 produced += b.size();
+                 return true;
+             })
+     .map([](pipeline_block<long> &b, int i) { b[i] = b[i] * 3; })
+     .map([](pipeline_block<long> &b, int i) { b[i] = b[i] - 1; }, map_sched::parallel<>())
+     .transform([&](pipeline_block<long> &b) { order.push_back(b.index()); })
+     .reduce([](const pipeline_block<long> &b, int i) { return b[i]; }, reduce_ops<long>::add, sum);
+    p.run();
+
+    long gold = 0;
+    for (size_t i = 0; i < Elems; ++i) {
+        gold += long(i) * 3 - 1;
+    }
+    assert(sum == gold);
+
+    assert(order.size() == (Elems + Block - 1) / Block);
+    for (size_t b = 0; b < order.size(); ++b) {
+        assert(order[b] == b);
+    }
+
+    // Empty stream, and a sink as terminal stage
+    size_t blocks = 0;
+    pipeline<float> empty(16);
+    empty.source([](pipeline_block<float> &) { return false; })
+         .sink([&](pipeline_block<float> &) { ++blocks; });
+    empty.run();
+    assert(blocks == 0);
+
+    // An exception in any stage stops the pipeline and is rethrown by run. Streams that never end would
+    // otherwise hang
+    for (int where = 0; where < 3; ++where) {
+        std::atomic<size_t> count(0);
+        pipeline<int> failing(16, 1);
+        failing.source([&](pipeline_block<int> &)
+                       {
+                           if (where == 0 && count >= 5) throw std::runtime_error("source");
+                           return true;
+                       })
+               .transform([&](pipeline_block<int> &)
+                          {
+                              if (where == 1 && count >= 5) throw std::runtime_error("transform");
+                          })
+               .sink([&](pipeline_block<int> &)
+                     {
+                         if (where == 2 && count >= 5) throw std::runtime_error("sink");
+                         ++count;
+                     });
+        bool caught = false;
+        try {
+            failing.run();
+        } catch (const std::runtime_error &) {
+            caught = true;
+        }
+        assert(caught);
+    }
+}
+
+void test_pipeline_blocks()
+{
+    print_banner("Produce, transform and aggregate");
+
+    static const size_t Elems = size_t(1) << 25;
+    static const size_t Block = size_t(1) << 16;
+
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+
+    // Every stage materializes the whole stream
+    start = std::chrono::system_clock::now();
+    std::vector<float> all(Elems);
+    map([&](int i) { all[i] = float(i % 1000); }, make_range(Elems));
+    map([&](int i) { all[i] = all[i] * 0.5f + 1.f; }, make_range(Elems));
+    double sum_all = reduce([&](int i) { return double(all[i]); }, reduce_ops<double>::add, make_range(Elems));
+    end = std::chrono::system_clock::now();
+    std::cout << "materialized: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+              << " usecs " << std::endl;
+
+    // Blocks flow through the stages
+    start = std::chrono::system_clock::now();
+    size_t produced = 0;
+    double sum_blocks = 0;
+    pipeline<float> p(Block);
+    p.source([&](pipeline_block<float> &b)
+             {
+                 if (produced == Elems) return false;
+
+                 for (size_t i = 0; i < b.size(); ++i) {
+                     b[i] = float((produced + i) % 1000);
+                 }
+                 produced += b.size();
+                 return true;
+             })
+     .map([](pipeline_block<float> &b, int i) { b[i] = b[i] * 0.5f + 1.f; })
+     .reduce([](const pipeline_block<float> &b, int i) { return double(b[i]); }, reduce_ops<double>::add, sum_blocks);
+    p.run();
+    end = std::chrono::system_clock::now();
+    std::cout << "pipeline: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+              << " usecs " << std::endl;
+
+    assert(sum_all == sum_blocks);
+}
+
+void test_curve()
+{
+    // Hilbert curves only move to a neighbor, in 2-D and 3-D
+    std::vector<std::vector<int>> visits;
+    map([&](int i, int j) { visits.push_back({ i, j }); }, make_range(16, 16), map_sched::hilbert<1, 1, false>());
+    map([&](int i, int j, int k) { visits.push_back({ i, j, k }); }, make_range(8, 8, 8),
+        map_sched::hilbert<1, 1, false>());
+    assert(visits.size() == 16 * 16 + 8 * 8 * 8);
+    for (size_t v = 1; v < visits.size(); ++v) {
+        if (v == 16 * 16) continue;
+
+        int dist = 0;
+        for (size_t d = 0; d < visits[v].size(); ++d) {
+            dist += std::abs(visits[v][d] - visits[v - 1][d]);
+        }
+        assert(dist == 1);
+    }
+
+    // Morton: Z order, leaves in row-major order
+    visits.clear();
+    map([&](int i, int j) { visits.push_back({ i, j }); }, make_range(4, 4), map_sched::morton<1, 1, false>());
+    assert(visits[0] == std::vector<int>({ 0, 0 }) && visits[1] == std::vector<int>({ 0, 1 }));
+    assert(visits[2] == std::vector<int>({ 1, 0 }) && visits[3] == std::vector<int>({ 1, 1 }));
+    assert(visits[4] == std::vector<int>({ 0, 2 }) && visits[15] == std::vector<int>({ 3, 3 }));
+
+    visits.clear();
+    map([&](int i, int j) { visits.push_back({ i, j }); }, make_range(4, 4), map_sched::morton<2, 2, false>());
+    assert(visits[2] == std::vector<int>({ 1, 0 }) && visits[4] == std::vector<int>({ 0, 2 }));
+
+    // Ranges with offsets, non power-of-two and elongated extents are covered exactly once
+    static const int N = 37;
+    static const int M = 1000;
+    dynarray<long, 2> a(N, M);
+    map([&](int i, int j) { a(i, j) = 0; }, make_range(N, M));
+    map([&](int i, int j) { a(i, j) += 1; }, make_range(dim<int>(1, N - 2), dim<int>(3, M)), map_sched::morton<>());
+    map([&](int i, int j) { a(i, j) += 1; }, make_range(dim<int>(1, N - 2), dim<int>(3, M)), map_sched::hilbert<>());
+    map([&](int i, int j)
+        {
+            bool inside = i >= 1 && i < N - 2 && j >= 3;
+            assert(a(i, j) == (inside? 2: 0));
+        },
+        make_range(N, M));
+
+    auto access = [&](int i, int j) { return long(i) * M + j; };
+    long gold = reduce(access, reduce_ops<long>::add, make_range(N, M));
+    assert(reduce(access, reduce_ops<long>::add, make_range(N, M), reduce_sched::morton<>()) == gold);
+    assert(reduce(access, reduce_ops<long>::add, make_range(N, M), reduce_sched::hilbert<3, 3, false>()) == gold);
+    auto access3 = [&](int i, int j, int k) { return long(i * 100 + j * 10 + k); };
+    assert(reduce(access3, reduce_ops<long>::greater_than, make_range(5, 6, 7), reduce_sched::hilbert<>()) == 456);
+    assert(reduce(access3, reduce_ops<long>::less_than, make_range(dim<int>(1, 5), dim<int>(2, 6), dim<int>(3, 7)),
+                  reduce_sched::morton<2>()) == 123);
+
+    // Empty ranges
+    map([&](int, int) { assert(false); }, make_range(0, 10), map_sched::hilbert<>());
+}
+
+void test_ragged()
+{
+    static const int N = 97;
+
+    dynarray<long, 2> a(N, N);
+
+    // Every element of each triangle is visited once, and only those
+    triangle kinds[] = { triangle::lower, triangle::strict_lower, triangle::upper, triangle::strict_upper };
+    for (triangle t : kinds) {
+        map([&](int i, int j) { a(i, j) = 0; }, make_range(N, N));
+
+        auto tri = make_triangle_range(N, t);
+        map([&](int i, int j) { a(i, j) += 1; }, tri, map_sched::parallel<>());
+
+        size_t count = 0;
+        for (int i = 0; i < N; ++i) {
+            for (int j = 0; j < N; ++j) {
+                bool inside = (t == triangle::lower        && j <= i) ||
+                              (t == triangle::strict_lower && j <  i) ||
+                              (t == triangle::upper        && j >= i) ||
+                              (t == triangle::strict_upper && j >  i);
+                assert(a(i, j) == (inside? 1: 0));
+                count += inside;
+            }
+        }
+        assert(tri.size() == count);
+
+        auto access = [&](int i, int j) { return long(i * N + j); };
+        long gold = 0;
+        for (int i = 0; i < N; ++i) {
+            for (int j = tri.row_begin(i); j < tri.row_end(i); ++j) {
+                gold += i * N + j;
+            }
+        }
+        assert(reduce(access, reduce_ops<long>::add, tri) == gold);
+        assert(reduce(access, reduce_ops<long>::add, tri, reduce_sched::parallel<>()) == gold);
+    }
+
+    // Ragged rows from a function, with empty rows
+    auto rows = make_ragged_range(N, [](int i) { return i % 3 == 0? 0: (i * 7) % 13; });
+    std::vector<long> visits(N, 0);
+    map([&](int i, int j) { assert(j < (i * 7) % 13); ++visits[i]; }, rows);
+    for (int i = 0; i < N; ++i) {
+        assert(visits[i] == (i % 3 == 0? 0: (i * 7) % 13));
+    }
+
+    // Ragged rows from offsets. The first element of a chunk can be in the middle of a row
+    std::vector<size_t> offs = { 0, 5, 5, 1000, 1001, 1001, 1500 };
+    auto csr = make_ragged_range(offs);
+    assert(csr.rows() == 6 && csr.size() == 1500);
+    assert(csr.find_row(5) == 2 && csr.find_row(1000) == 3 && csr.find_row(1001) == 5);
+    long count = reduce([](int, int) { return 1L; }, reduce_ops<long>::add, csr, reduce_sched::parallel<>());
+    assert(count == 1500);
+    long last = reduce([](int i, int j) { return long(i * 10000 + j); }, reduce_ops<long>::greater_than, csr);
+    assert(last == 5 * 10000 + 498);
+
+    // Empty ranges
+    map([](int, int) { assert(false); }, make_triangle_range(0), map_sched::parallel<>());
+    map([](int, int) { assert(false); }, make_triangle_range(1, triangle::strict_lower), map_sched::parallel<>());
+}
+
+void test_strided()
+{
+    // Steps that do not divide the extent, negative and compile-time steps
+    std::vector<int> visits;
+    map([&](int i) { visits.push_back(i); }, make_range(dim_int(1, 20, 3)));
+    assert(visits == std::vector<int>({ 1, 4, 7, 10, 13, 16, 19 }));
+
+    visits.clear();
+    map([&](int i) { visits.push_back(i); }, make_range(dim_int(10, 0, -3)));
+    assert(visits == std::vector<int>({ 10, 7, 4, 1 }));
+
+    visits.clear();
+    map([&](int i) { visits.push_back(i); }, make_range(dim_fancy<int, 2>(3, 10)));
+    assert(visits == std::vector<int>({ 3, 5, 7, 9 }));
+
+    visits.clear();
+    map([&](int i) { visits.push_back(i); }, make_range(dim_int(5, 5, 1)));
+    map([&](int i) { visits.push_back(i); }, make_range(dim_int(0, 5, -1)));
+    assert(visits.empty());
+
+    const range_fancy<2> r(dim_int(1, 100, 7), dim_int(50, -3, -4));
+    assert(dim_trips(r.get_dim(0)) == 15 && dim_trips(r.get_dim(1)) == 14);
+
+    int count = 0;
+    for (iterator<int> it(r.get_dim(1)); it; ++it) {
+        assert((50 - *it) % 4 == 0 && *it > -3);
+        ++count;
+    }
+    assert(count == 14);
+
+    // Serial and parallel maps and reduces visit the same elements
+    static const int N = 103;
+    dynarray<long, 2> a(N, N), b(N, N);
+    map([&](int i, int j) { a(i, j) = b(i, j) = 0; }, make_range(N, N));
+    map([&](int i, int j) { a(i, j) += i + j; }, make_range(dim_int(N - 1, 0, -2), dim_int(1, N, 3)));
+    map([&](int i, int j) { b(i, j) += i + j; }, make_range(dim_int(N - 1, 0, -2), dim_int(1, N, 3)),
+        map_sched::parallel<>());
+    assert(a == b);
+
+    auto access = [&](int i, int j) { return a(i, j) * (i + 1) - j; };
+    long gold = 0;
+    for (int i = N - 1; i > 0; i -= 2) {
+        for (int j = 1; j < N; j += 3) {
+            gold += access(i, j);
+        }
+    }
+    range_fancy<2> strided(dim_int(N - 1, 0, -2), dim_int(1, N, 3));
+    assert(reduce(access, reduce_ops<long>::add, strided) == gold);
+    assert(reduce(access, reduce_ops<long>::add, strided, reduce_sched::parallel<>()) == gold);
+    assert(reduce(access, reduce_ops<long>::add, strided, reduce_sched::parallel<1>()) == gold);
+    assert(reduce(access, reduce_ops<long>::add, make_range(dim_fancy<int, 2>(1, N), dim_fancy<int, 2>(0, N)),
+                  reduce_sched::parallel<>()) ==
+           reduce(access, reduce_ops<long>::add, make_range(dim_fancy<int, 2>(1, N), dim_fancy<int, 2>(0, N))));
+    assert(reduce([](int i) { return long(i); }, reduce_ops<long>::add, make_range(dim_int(0, 0, 1)),
+                  reduce_sched::parallel<>()) == 0);
+    // Empty inner dimensions
+    auto never = [](int, int) -> long { assert(false); return 1; };
+    assert(reduce(never, reduce_ops<long>::add, make_range(4, 0)) == 0);
+    assert(reduce(never, reduce_ops<long>::add, make_range(4, 0), reduce_sched::parallel<>()) == 0);
+    assert(reduce(never, reduce_ops<long>::add, make_range(4, 0), reduce_sched::parallel<1>()) == 0);
+    assert(reduce(never, reduce_ops<long>::add, make_range(dim_int(0, 8, 2), dim_int(3, 5, -1))) == 0);
+    assert(reduce([](int, int, int) { return 1L; }, reduce_ops<long>::add, make_range(3, 4, 0)) == 0);
+
+    // Red-black Gauss-Seidel: the points of one color only read points of the other one
+    dynarray<double, 2> x(N, N), y(N, N);
+    map([&](int i, int j) { x(i, j) = y(i, j) = double((i * 7 + j * 3) % 11); }, make_range(N, N));
+    for (int color = 0; color < 2; ++color) {
+        for (int i = 1; i < N - 1; ++i) {
+            for (int j = 1 + (i + 1 + color) % 2; j < N - 1; j += 2) {
+                x(i, j) = (x(i - 1, j) + x(i + 1, j) + x(i, j - 1) + x(i, j + 1)) / 4;
+            }
+        }
+    }
+    for (int color = 0; color < 2; ++color) {
+        auto update = [&](int i, int j) { y(i, j) = (y(i - 1, j) + y(i + 1, j) + y(i, j - 1) + y(i, j + 1)) / 4; };
+        map(update, make_range(dim_fancy<int, 2>(1, N - 1), dim_fancy<int, 2>(1 + color, N - 1)),
+            map_sched::parallel<>());
+        map(update, make_range(dim_fancy<int, 2>(2, N - 1), dim_fancy<int, 2>(2 - color, N - 1)),
+            map_sched::parallel<>());
+    }
+    assert(x == y);
+}
+
+void test_masked()
+{
+    static const int N = 131;
+    static const int M = 67;
+
+    auto active = [](int i, int j) { return (i * 31 + j * 17) % 23 == 0; };
+
+    dynarray<long, 2> a(N, M), b(N, M);
+    map([&](int i, int j) { a(i, j) = b(i, j) = 0; }, make_range(N, M));
+    map([&](int i, int j) { if (active(i, j)) a(i, j) += i - j; }, make_range(N, M));
+
+    // Only the active elements are visited, once, in the order of the range
+    active_set<range<2>> set(active, make_range(N, M));
+    assert(set.range_size() == size_t(N * M));
+    size_t count = 0;
+    for (int i = 0; i < N; ++i) {
+        for (int j = 0; j < M; ++j) {
+            if (!active(i, j)) continue;
+            assert(set[count][0] == i && set[count][1] == j);
+            ++count;
+        }
+    }
+    assert(set.size() == count);
+
+    map_masked([&](int i, int j) { b(i, j) += i - j; }, set, map_sched::parallel<>());
+    assert(a == b);
+
+    // The list is reused until the mask changes
+    map_masked([&](int i, int j) { b(i, j) -= i - j; }, set);
+    set.rebuild([](int i, int j) { return i == j; });
+    assert(set.size() == size_t(M));
+    map_masked([&](int i, int j) { b(i, j) += 1; }, set, map_sched::parallel<>());
+    assert(reduce([&](int i, int j) { return b(i, j); }, reduce_ops<long>::add, make_range(N, M)) == M);
+
+    // Bitmasks, in row-major order over strided dimensions. Bits past the range are ignored
+    auto strided = make_range(dim_int(N - 1, 0, -2), dim_int(3, M, 5));
+    size_t elems = size_t(dim_trips(strided.get_dim(0)) * dim_trips(strided.get_dim(1)));
+    std::vector<uint64_t> bits((elems + MaskWordBits - 1) / MaskWordBits, ~uint64_t(0));
+    for (size_t w = 0; w < elems; ++w) {
+        if (w % 3 != 0) bits[w / MaskWordBits] &= ~(uint64_t(1) << (w % MaskWordBits));
+    }
+    std::vector<std::pair<int, int>> visits, gold;
+    size_t w = 0;
+    map([&](int i, int j) { if (w++ % 3 == 0) gold.push_back(std::make_pair(i, j)); }, strided);
+    map_masked([&](int i, int j) { visits.push_back(std::make_pair(i, j)); }, bits, strided);
+    assert(visits == gold);
+
+    active_set<range_fancy<2>> from_bits(bits, strided);
+    active_set<range_fancy<2>> from_pred([](int i, int) { return i % 4 == 2; }, strided);
+    assert(from_bits.size() == gold.size() && from_pred.size() > 0);
+
+    // 1-D and 3-D ranges, and empty sets
+    std::vector<long> c(1000, 0);
+    map_masked([&](int i) { c[i] = i; }, [](int i) { return i % 7 == 0; }, make_range(1000),
+               map_sched::parallel<>());
+    for (int i = 0; i < 1000; ++i) {
+        assert(c[i] == (i % 7 == 0? i: 0));
+    }
+
+    long sum = 0;
+    map_masked([&](int i, int j, int k) { sum += i * 100 + j * 10 + k; },
+               [](int i, int j, int k) { return i == j && j == k; }, make_range(10, 10, 10));
+    assert(sum == 111 * 45);
+
+    auto none = make_active_set([](int) { return false; }, make_range(100));
+    assert(none.empty());
+    map_masked([](int) { assert(false); }, none, map_sched::parallel<>());
+    map_masked([](int) { assert(false); }, [](int) { return true; }, make_range(0), map_sched::parallel<>());
+}
+
+void test_ref()
+{
+    array<int[10][1]> a;
+    array_ref<int[10][1]> a_ref(a);
+    array_ref<int[1][10]> b_ref(a.reshape<int[1][10]>());
+}
+
+void test_stream()
+{
+    static const size_t N = 1000;
+    static const size_t M = 100;
+
+    char path[] = "/tmp/map-reduce-stream-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    {
+        stream_array<long, 2> out(path, stream_mode::write, N, M);
+        out.set_chunk_rows(64);
+
+        stream_map([&](int i, int j)
+                   {
+                       out(i, j) = i * M + j;
+                   },
+                   out);
+    }
+
+    {
+        stream_array<long, 2> inout(path, stream_mode::read_write, N, M);
+        inout.set_chunk_rows(96);
+
+        stream_map([&](int i, int j)
+                   {
+                       inout(i, j) *= 2;
+                   },
+                   inout);
+    }
+
+    stream_array<long, 2> in(path, stream_mode::read, N, M);
+    in.set_chunk_rows(128);
+
+    long sum = stream_reduce_sum([&](int i, int j)
+                                 {
+                                     return in(i, j);
+                                 },
+                                 in);
+
+    assert(sum == long(N * M) * long(N * M - 1));
+
+    long max = stream_reduce([&](int i, int j)
+                             {
+                                 return in(i, j);
+                             },
+                             reduce_ops<long>::greater_than,
+                             in);
+
+    assert(max == 2 * long(N * M - 1));
+
+    // A read_write stream over a smaller array leaves the rest of the file alone
+    {
+        stream_array<long, 2> head(path, stream_mode::read_write, N / 2, M);
+        stream_map([&](int i, int j) { head(i, j) += 1; }, head);
+    }
+    struct stat st;
+    int ret = stat(path, &st);
+    assert(ret == 0 && size_t(st.st_size) == N * M * sizeof(long));
+    (void) ret;
+    stream_array<long, 2> all(path, stream_mode::read, N, M);
+    sum = stream_reduce_sum([&](int i, int j) { return all(i, j); }, all);
+    assert(sum == long(N * M) * long(N * M - 1) + long(N * M / 2));
+
+    // Missing and short files are reported
+    bool caught = false;
+    try {
+        stream_array<long, 2> big(path, stream_mode::read, 2 * N, M);
+    } catch (const std::runtime_error &) {
+        caught = true;
+    }
+    assert(caught);
+
+    // Streams of different sizes are rejected
+    caught = false;
+    try {
+        stream_array<long, 2> half(path, stream_mode::read, N / 2, M);
+        stream_reduce_sum([&](int i, int j) { return all(i, j) + half(i, j); }, all, half);
+    } catch (const std::invalid_argument &) {
+        caught = true;
+    }
+    assert(caught);
+
+    // Errors of the background reads are rethrown by the pass
+    caught = false;
+    try {
+        stream_array<long, 2> cut(path, stream_mode::read, N, M);
+        cut.set_chunk_rows(64);
+        int ret = truncate(path, off_t(M * sizeof(long)));
+        assert(ret == 0);
+        (void) ret;
+        stream_reduce_sum([&](int i, int j) { return cut(i, j); }, cut);
+    } catch (const std::runtime_error &) {
+        caught = true;
+    }
+    assert(caught);
+
+    unlink(path);
+
+    caught = false;
+    try {
+        stream_array<long, 2> missing(path, stream_mode::read, N, M);
+    } catch (const std::system_error &e) {
+        caught = e.code().value() == ENOENT;
+    }
+    assert(caught);
+}
+
+void test_io()
+{
+    char path[] = "/tmp/map-reduce-io-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    dynarray<int, 3> a(7, 33, 5);
+    map([&](int i, int j, int k)
+        {
+            a(i, j, k) = (i * 33 + j) * 5 + k;
+        },
+        make_range(7, 33, 5));
+
+    save(path, a);
+
+    {
+        mapped_dynarray<int, 3> m(path);
+        assert(m.check());
+        assert(m.get_size(0) == 7 && m.get_size(1) == 33 && m.get_size(2) == 5);
+        assert(m == a);
+        assert(m[6][32][4] == a(6, 32, 4));
+    }
+
+    array<double[10][20]> b;
+    map([&](int i, int j)
+        {
+            b[i][j] = i * 0.5 + j;
+        },
+        make_range(10, 20));
+
+    save(path, b);
+
+    {
+        mapped_array<double[10][20]> m(path);
+        assert(m.check());
+        assert(m.header().type == file_type::float64);
+        for (unsigned i = 0; i < 10; ++i) {
+            for (unsigned j = 0; j < 20; ++j) {
+                assert(m[i][j] == b[i][j]);
+            }
+        }
+    }
+
+    // Files that do not match the array, or are not valid, throw
+    auto fails = [&](std::function<void()> load)
+                 {
+                     try {
+                         load();
+                     } catch (const std::runtime_error &) {
+                         return true;
+                     }
+                     return false;
+                 };
+    assert(fails([&]() { mapped_dynarray<float, 2> m(path); }));
+    assert(fails([&]() { mapped_dynarray<double, 3> m(path); }));
+    assert(fails([&]() { mapped_array<double[10][21]> m(path); }));
+
+    int ret = truncate(path, off_t(FileAlignment + 100));
+    assert(ret == 0);
+    assert(fails([&]() { mapped_array<double[10][20]> m(path); }));
+
+    ret = truncate(path, off_t(sizeof(file_header) + 10));
+    assert(ret == 0);
+    std::vector<char> junk(sizeof(file_header) + 10, 'x');
+    fd = open(path, O_WRONLY);
+    assert(fd != -1);
+    ssize_t written = write(fd, junk.data(), junk.size());
+    assert(written == ssize_t(junk.size()));
+    close(fd);
+    assert(fails([&]() { mapped_array<double[10][20]> m(path); }));
+
+    unlink(path);
+    assert(fails([&]() { mapped_array<double[10][20]> m(path); }));
+    (void) ret;
+    (void) written;
+}
+
+void test_view()
+{
+    static const size_t N = 60;
+    static const size_t M = 80;
+
+    dynarray<long, 2> a(N, M);
+    map([&](int i, int j)
+        {
+            a(i, j) = i * M + j;
+        },
+        make_range(N, M));
+
+    strided_view<long, 2> t = make_view(a).transpose();
+    assert(t.get_size(0) == M && t.get_size(1) == N);
+    assert(t(5, 7) == a(7, 5));
+
+    // Rows 10, 13, ..., 49 and columns 70, 68, ..., 22
+    strided_view<long, 2> s = make_view(a).slice(0, 10, 50, 3).slice(1, 70, 20, -2);
+    assert(s.get_size(0) == 14 && s.get_size(1) == 25);
+    assert(s(2, 3) == a(16, 64));
+
+    long sum = reduce_sum([&](int i, int j)
+                          {
+                              return s(i, j);
+                          },
+                          s);
+    long gold = 0;
+    for (unsigned i = 0; i < s.get_size(0); ++i) {
+        for (unsigned j = 0; j < s.get_size(1); ++j) {
+            gold += a(10 + 3 * i, 70 - 2 * j);
+        }
+    }
+    assert(sum == gold);
+
+    sum = reduce([&](int i, int j)
+                 {
+                     return s(i, j);
+                 },
+                 reduce_ops<long>::add,
+                 s,
+                 reduce_sched::parallel<>());
+    assert(sum == gold);
+
+    // Chunks are combined in order: a non-commutative operator gives the same result as the serial reduce
+    auto last = [](long, long y) { return y; };
+    auto position = [](int i, int j) { return long(i) * 1000 + j; };
+    assert(reduce(position, last, s, reduce_sched::parallel<>()) == reduce(position, last, s));
+
+    // Writes through the transposed and reversed view land on the original elements
+    strided_view<long, 2> r = t.reverse(1);
+    map([&](int i, int j)
+        {
+            r(i, j) = -r(i, j);
+        },
+        r,
+        map_sched::parallel<>());
+    assert(a(0, 0) == 0 && a(N - 1, M - 1) == -long(N * M - 1) && a(3, 4) == -long(3 * M + 4));
+
+    const dynarray<long, 2> &c = a;
+    strided_view<const long, 2> cv = make_view(c).reverse(0);
+    assert(cv(0, 0) == a(N - 1, 0));
 }
 
 int main(int argc, char *argv[])
 {
     test_array();
     test_dynarray();
+    test_dynarray_layout();
+    test_dynarray_extents();
+    test_soa();
+    test_sparse();
+    test_half();
+    test_copy();
+    test_alloc();
+    test_gemm();
+    test_stencil_blocking();
+    test_stencil_spec();
+    test_convolution();
+    test_iterate();
+    test_transpose_library();
+    test_batch();
+    test_expr();
+    test_expr_pipeline();
+    test_graph();
+    test_async();
+    test_async_calls();
+    test_pipeline();
+    test_pipeline_blocks();
+    test_curve();
+    test_ragged();
+    test_strided();
+    test_masked();
     test_ref();
+    test_stream();
+    test_io();
+    test_view();
 
     test_reduction();
 